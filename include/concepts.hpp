@@ -24,6 +24,7 @@
 #define INCLUDED_BAE_CITY_BEAST_CONCEPTS_HPP
 
 #include <concepts>
+#include <cstdint>
 #include <type_traits>
 #include <string>
 #include <string_view>
@@ -47,6 +48,8 @@ namespace bae::city::beast {
     concept ServiceConfigConcept =
         requires(T x) {
             typename std::remove_cvref_t<T>::Context;
+            // provide listeners to accept connections on
+            { x.listeners() };
             // configure (SSL) context
             { x.configure(std::declval<typename std::remove_cvref_t<T>::Context&>())};
         };
@@ -68,10 +71,16 @@ namespace bae::city::beast {
             { x.send(x.bad_request(std::declval<std::string>())) };
             { x.send(x.not_found(std::declval<std::string>())) };
             { x.send(x.server_error(std::declval<std::string>())) };
+            { x.send(x.bad_gateway(std::declval<std::string>())) };
+            { x.send(x.too_many_requests()) };
+            { x.send(x.not_modified(std::declval<std::string>(), std::declval<std::string>())) };
+            { x.send(x.range_not_satisfiable(std::declval<std::uint64_t>())) };
             { x.send(x.success()) };
             { x.send(x.text_response(std::declval<std::string>())) };
+            // ...or open response to be written piece by piece
+            { x.open_response(std::declval<std::string>()).write(std::declval<std::string_view>()) };
             { x.send(x.file_response(
-                std::declval<typename std::remove_cvref_t<T>::FileBody>(),
+                std::declval<typename std::remove_cvref_t<T>::FileBody::value_type>(),
                 std::declval<std::string>())) };
             // should provide access to underlying boost::beast::http::request<>
             { x.request() } -> std::convertible_to<typename std::remove_cvref_t<T>::RequestType>;
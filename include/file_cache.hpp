@@ -0,0 +1,520 @@
+// MIT License
+// 
+// Copyright (c) 2023 Sadhbh Code
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef INCLUDED_BAE_CITY_BEAST_FILE_CACHE_HPP
+#define INCLUDED_BAE_CITY_BEAST_FILE_CACHE_HPP
+
+#include "concepts.hpp"
+
+#include <boost/beast/core/file.hpp>
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+
+namespace bae::city::beast {
+
+    //! Validators of file, computed from its metadata
+    struct FileInfo
+    {
+        std::uint64_t size;
+        std::time_t modified;
+        std::string etag;           //< weak, if file was modified within last second
+        std::string last_modified;  //< as HTTP date
+    };
+
+    //! Inclusive range of bytes
+    struct ByteRange
+    {
+        std::uint64_t first;
+        std::uint64_t last;
+
+        std::uint64_t size() const { return last - first + 1; }
+    };
+
+    inline std::string http_date(std::time_t time)
+    {
+        std::tm tm{};
+        ::gmtime_r(&time, &tm);
+
+        char buf[64];
+        auto size = std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return {buf, size};
+    }
+
+    inline std::optional<std::time_t> parse_http_date(std::string_view text)
+    {
+        std::tm tm{};
+        auto str = std::string(text);
+        auto end = ::strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (!end || *end != '\0')
+            return std::nullopt;
+
+        return ::timegm(&tm);
+    }
+
+    //! Check whether entity tag matches any from the list, i.e. If-None-Match
+    //
+    // Weak comparison ignores W/ prefix of either tag, strong comparison
+    // requires both tags to be strong and equal.
+    //
+    inline bool etag_matches(std::string_view list, std::string_view etag, bool weak)
+    {
+        auto strip = [](std::string_view tag)
+        {
+            return tag.starts_with("W/") ? tag.substr(2) : tag;
+        };
+
+        if (!weak && etag.starts_with("W/"))
+            return false;
+
+        for (std::size_t pos = 0; pos < list.size();)
+        {
+            auto end = std::min(list.find(',', pos), list.size());
+            auto tag = list.substr(pos, end - pos);
+            pos = end + 1;
+
+            auto first = tag.find_first_not_of(" \t");
+            if (first == std::string_view::npos)
+                continue;
+            tag = tag.substr(first, tag.find_last_not_of(" \t") - first + 1);
+
+            if (tag == "*")
+                return true;
+            if (!weak && tag.starts_with("W/"))
+                continue;
+            if (strip(tag) == strip(etag))
+                return true;
+        }
+
+        return false;
+    }
+
+    //! Check whether client already has the current representation
+    //
+    // Usable for any response with validators, not just files. If-None-Match
+    // takes precedence over If-Modified-Since, and both apply to GET and HEAD.
+    //
+    template<typename _RequestType>
+    bool is_not_modified(
+        const _RequestType &req,
+        std::string_view etag,
+        std::optional<std::time_t> modified)
+    {
+        namespace http = boost::beast::http;
+
+        if (req.method() != http::verb::get && req.method() != http::verb::head)
+            return false;
+
+        auto if_none_match = req[http::field::if_none_match];
+        if (!if_none_match.empty())
+            return !etag.empty() && etag_matches(
+                {if_none_match.data(), if_none_match.size()}, etag, true);
+
+        auto if_modified_since = req[http::field::if_modified_since];
+        if (!if_modified_since.empty() && modified)
+        {
+            auto since = parse_http_date({if_modified_since.data(), if_modified_since.size()});
+            return since && *modified <= *since;
+        }
+
+        return false;
+    }
+
+    //! Parse Range header, i.e. "bytes=0-99,200-,-50"
+    //
+    // Returns nullopt if header is invalid, or asks for more than max_ranges,
+    // in which case it should be ignored. Returns empty vector if none of the
+    // ranges can be satisfied.
+    //
+    // Ranges are sorted, and overlapping or adjacent ones are merged, so that
+    // no byte is sent twice, however many times the client asked for it.
+    //
+    inline std::optional<std::vector<ByteRange>> parse_ranges(
+        std::string_view header, std::uint64_t size, std::size_t max_ranges = 16)
+    {
+        if (!header.starts_with("bytes="))
+            return std::nullopt;
+
+        auto parse_number = [](std::string_view text) -> std::optional<std::uint64_t>
+        {
+            std::uint64_t value = 0;
+            auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+            if (ec != std::errc{} || ptr != text.data() + text.size() || text.empty())
+                return std::nullopt;
+            return value;
+        };
+
+        std::vector<ByteRange> ranges;
+        std::size_t count = 0;
+
+        header.remove_prefix(6);
+        for (std::size_t pos = 0; pos <= header.size();)
+        {
+            auto end = std::min(header.find(',', pos), header.size());
+            auto spec = header.substr(pos, end - pos);
+            pos = end + 1;
+
+            auto first = spec.find_first_not_of(" \t");
+            if (first == std::string_view::npos)
+                continue;
+            spec = spec.substr(first, spec.find_last_not_of(" \t") - first + 1);
+
+            if (++count > max_ranges)
+                return std::nullopt;
+
+            auto dash = spec.find('-');
+            if (dash == std::string_view::npos)
+                return std::nullopt;
+
+            if (dash == 0)
+            {
+                // Suffix range, i.e. last N bytes
+                auto suffix = parse_number(spec.substr(1));
+                if (!suffix)
+                    return std::nullopt;
+                if (*suffix != 0 && size != 0)
+                    ranges.push_back({size - std::min(*suffix, size), size - 1});
+                continue;
+            }
+
+            auto from = parse_number(spec.substr(0, dash));
+            if (!from)
+                return std::nullopt;
+
+            auto to = std::optional<std::uint64_t>{size ? size - 1 : 0};
+            if (dash + 1 != spec.size())
+            {
+                to = parse_number(spec.substr(dash + 1));
+                if (!to || *to < *from)
+                    return std::nullopt;
+            }
+
+            if (*from < size)
+                ranges.push_back({*from, std::min(*to, size - 1)});
+        }
+
+        if (count == 0)
+            return std::nullopt;
+
+        std::sort(ranges.begin(), ranges.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+        std::vector<ByteRange> merged;
+        for (auto &range : ranges)
+        {
+            if (!merged.empty() && range.first <= merged.back().last + 1)
+                merged.back().last = std::max(merged.back().last, range.last);
+            else
+                merged.push_back(range);
+        }
+
+        return merged;
+    }
+
+    //! Serves files answering conditional and range requests
+    //
+    // Validators are computed from file metadata once, and kept until
+    // revalidate_after elapses, so that most requests do not even stat the
+    // file. Not modified responses never open the file. Other responses
+    // take validators and size from the file opened, so that they always
+    // describe the content sent, even if file was replaced meanwhile.
+    // Ranges are read straight from the file piece by piece.
+    //
+    // Memory is bounded by capacity, and cache is cleared when it is full.
+    //
+    struct FileCache
+    {
+        using Clock = std::chrono::steady_clock;
+
+        explicit FileCache(
+            std::size_t capacity = 4096,
+            std::chrono::milliseconds revalidate_after = std::chrono::seconds(1))
+            : m_capacity(capacity)
+            , m_revalidate_after(revalidate_after) {}
+
+        FileCache(const FileCache &) = delete;
+        FileCache &operator =(const FileCache &) = delete;
+
+        //! Validators of the file, or nullopt if it is not regular file
+        std::optional<FileInfo> info(const std::string &path)
+        {
+            auto const now = Clock::now();
+            {
+                std::lock_guard lock{m_mutex};
+                auto it = m_entries.find(path);
+                if (it != m_entries.end() && now - it->second.checked < m_revalidate_after)
+                    return it->second.info;
+            }
+
+            struct stat st{};
+            if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            {
+                std::lock_guard lock{m_mutex};
+                m_entries.erase(path);
+                return std::nullopt;
+            }
+
+            auto info = describe(st);
+            remember(path, info, now);
+            return info;
+        }
+
+        void serve(RequestConcept auto &request, const std::string &path, std::string mime_type)
+        {
+            namespace http = boost::beast::http;
+
+            auto cached = this->info(path);
+            if (!cached)
+                return request.send(request.not_found(path));
+
+            if (is_not_modified(request.request(), cached->etag, cached->modified))
+                return request.send(request.not_modified(cached->etag, cached->last_modified));
+
+            // Cached validators might be stale, so that those of the file
+            // actually sent are taken from its descriptor
+            boost::beast::error_code ec;
+            boost::beast::file file;
+            file.open(
+                path.c_str(),
+                request[http::field::range].empty() ? boost::beast::file_mode::scan : boost::beast::file_mode::read,
+                ec);
+            if (ec == boost::system::errc::no_such_file_or_directory)
+                return request.send(request.not_found(path));
+            if (ec)
+                return request.send(request.server_error(ec.message()));
+
+            struct stat st{};
+            if (::fstat(file.native_handle(), &st) != 0 || !S_ISREG(st.st_mode))
+                return request.send(request.not_found(path));
+
+            auto const info = describe(st);
+            if (info.etag != cached->etag)
+            {
+                remember(path, info, Clock::now());
+
+                if (is_not_modified(request.request(), info.etag, info.modified))
+                    return request.send(request.not_modified(info.etag, info.last_modified));
+            }
+
+            if (request->method() == http::verb::head)
+            {
+                auto res = request.success();
+                res.set(http::field::content_type, mime_type);
+                res.content_length(info.size);
+                set_validators(res, info);
+                return request.send(std::move(res));
+            }
+
+            if (auto ranges = requested_ranges(request, info))
+            {
+                if (ranges->empty())
+                    return request.send(request.range_not_satisfiable(info.size));
+
+                return send_ranges(request, file, std::move(mime_type), info, *ranges);
+            }
+
+            http::file_body::value_type body;
+            body.reset(std::move(file), ec);
+            if (ec)
+                return request.send(request.server_error(ec.message()));
+
+            auto res = request.file_response(std::move(body), std::move(mime_type));
+            set_validators(res, info);
+            return request.send(std::move(res));
+        }
+
+    private:
+        struct Entry
+        {
+            FileInfo info;
+            Clock::time_point checked;
+        };
+
+        const std::size_t m_capacity;
+        const std::chrono::milliseconds m_revalidate_after;
+
+        std::mutex m_mutex;
+        std::unordered_map<std::string, Entry> m_entries;
+
+        void remember(const std::string &path, const FileInfo &info, Clock::time_point now)
+        {
+            std::lock_guard lock{m_mutex};
+            if (m_entries.size() >= m_capacity && !m_entries.contains(path))
+                m_entries.clear();
+            m_entries.insert_or_assign(path, Entry{info, now});
+        }
+
+        static FileInfo describe(const struct stat &st)
+        {
+            // File modified within the last second could change again without
+            // changing its modification time, so that its tag can only be weak
+            bool const weak = std::time(nullptr) - st.st_mtim.tv_sec < 1;
+
+            char buf[64];
+            auto size = std::snprintf(
+                buf, sizeof(buf), "%s\"%llx-%llx\"",
+                weak ? "W/" : "",
+                static_cast<unsigned long long>(st.st_size),
+                static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec);
+
+            return FileInfo{
+                static_cast<std::uint64_t>(st.st_size),
+                st.st_mtim.tv_sec,
+                std::string(buf, size),
+                http_date(st.st_mtim.tv_sec)};
+        }
+
+        template<typename _Response>
+        static void set_validators(_Response &res, const FileInfo &info)
+        {
+            namespace http = boost::beast::http;
+
+            res.set(http::field::etag, info.etag);
+            res.set(http::field::last_modified, info.last_modified);
+            res.set(http::field::accept_ranges, "bytes");
+        }
+
+        //! Ranges to send, or nullopt to send whole file
+        static std::optional<std::vector<ByteRange>> requested_ranges(
+            RequestConcept auto &request, const FileInfo &info)
+        {
+            namespace http = boost::beast::http;
+
+            auto range = request[http::field::range];
+            if (range.empty() || request->method() != http::verb::get)
+                return std::nullopt;
+
+            // Ranges only apply to the representation client already has part of
+            auto if_range = request[http::field::if_range];
+            if (!if_range.empty())
+            {
+                auto value = std::string_view{if_range.data(), if_range.size()};
+                bool const matches = value.starts_with("\"") || value.starts_with("W/")
+                    ? etag_matches(value, info.etag, false)
+                    : value == info.last_modified;
+                if (!matches)
+                    return std::nullopt;
+            }
+
+            auto ranges = parse_ranges({range.data(), range.size()}, info.size);
+
+            // Whole file is better sent as it is
+            if (ranges && ranges->size() == 1 && ranges->front().size() == info.size)
+                return std::nullopt;
+
+            return ranges;
+        }
+
+        static void send_ranges(
+            RequestConcept auto &request,
+            boost::beast::file &file,
+            std::string mime_type,
+            const FileInfo &info,
+            const std::vector<ByteRange> &ranges)
+        {
+            namespace http = boost::beast::http;
+
+            auto content_range = [&](const ByteRange &range)
+            {
+                return "bytes " + std::to_string(range.first) + "-" +
+                    std::to_string(range.last) + "/" + std::to_string(info.size);
+            };
+
+            if (ranges.size() == 1)
+            {
+                auto writer = request.open_response(std::move(mime_type), ranges.front().size());
+                writer.header().result(http::status::partial_content);
+                writer.header().set(http::field::content_range, content_range(ranges.front()));
+                set_validators(writer.header(), info);
+
+                copy_range(file, ranges.front(), writer);
+                writer.finish();
+                return;
+            }
+
+            // Multiple ranges are sent as multipart/byteranges, and length of
+            // whole body is known upfront from part headers and range sizes
+            auto const boundary = "bae-city-beast-" + std::to_string(std::hash<std::string>{}(info.etag));
+
+            std::vector<std::string> parts;
+            std::uint64_t length = 0;
+            for (auto &range : ranges)
+            {
+                parts.push_back(
+                    "\r\n--" + boundary + "\r\n"
+                    "Content-Type: " + mime_type + "\r\n"
+                    "Content-Range: " + content_range(range) + "\r\n"
+                    "\r\n");
+                length += parts.back().size() + range.size();
+            }
+            auto const closing = "\r\n--" + boundary + "--\r\n";
+            length += closing.size();
+
+            auto writer = request.open_response("multipart/byteranges; boundary=" + boundary, length);
+            writer.header().result(http::status::partial_content);
+            set_validators(writer.header(), info);
+
+            for (std::size_t i = 0; i != ranges.size(); ++i)
+            {
+                if (!writer.write(parts[i]) || !copy_range(file, ranges[i], writer))
+                    return;
+            }
+
+            if (writer.write(closing))
+                writer.finish();
+        }
+
+        template<typename _Writer>
+        static bool copy_range(boost::beast::file &file, const ByteRange &range, _Writer &writer)
+        {
+            boost::beast::error_code ec;
+            file.seek(range.first, ec);
+            if (ec)
+                return false;
+
+            char buf[8192];
+            for (auto remain = range.size(); remain != 0;)
+            {
+                auto n = file.read(buf, std::min<std::uint64_t>(remain, sizeof(buf)), ec);
+                if (ec || n == 0)
+                    return false;
+                if (!writer.write({buf, n}))
+                    return false;
+                remain -= n;
+            }
+
+            return true;
+        }
+    };
+
+} //namespace bae::city::beast
+#endif//INCLUDED_BAE_CITY_BEAST_FILE_CACHE_HPP
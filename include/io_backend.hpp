@@ -0,0 +1,133 @@
+// MIT License
+// 
+// Copyright (c) 2023 Sadhbh Code
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef INCLUDED_BAE_CITY_BEAST_IO_BACKEND_HPP
+#define INCLUDED_BAE_CITY_BEAST_IO_BACKEND_HPP
+
+#include <boost/asio/detail/config.hpp>
+#include <cstdlib>
+#include <string>
+
+#ifdef __linux__
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(BOOST_ASIO_HAS_IO_URING)
+#include <liburing.h>
+#elif __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+
+namespace bae::city::beast {
+
+    //! Whether Asio was built to use io_uring for sockets
+    constexpr bool is_io_uring_backend()
+    {
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    //! Name of the backend Asio was built with
+    constexpr const char *io_backend_name()
+    {
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+        return "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+        return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+        return "kqueue";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+        return "iocp";
+#else
+        return "select";
+#endif
+    }
+
+    //! Check whether the kernel lets this process use io_uring as Asio does
+    //
+    // It may be missing in older kernels, or disabled by sysctl or seccomp.
+    // Kernels since 5.1 can set up io_uring, but lack some of the operations
+    // Asio submits, so that those are probed for when built with liburing.
+    //
+    inline bool io_uring_supported()
+    {
+#if defined(BOOST_ASIO_HAS_IO_URING)
+        // Probe is only available since 5.6, and fails without io_uring at all
+        auto probe = ::io_uring_get_probe();
+        if (!probe)
+            return false;
+
+        bool supported = true;
+        for (int op : {
+                 IORING_OP_ACCEPT,
+                 IORING_OP_CONNECT,
+                 IORING_OP_SENDMSG,
+                 IORING_OP_RECVMSG,
+                 IORING_OP_READV,
+                 IORING_OP_WRITEV,
+                 IORING_OP_POLL_ADD,
+                 IORING_OP_TIMEOUT,
+                 IORING_OP_ASYNC_CANCEL})
+            supported = supported && ::io_uring_opcode_supported(probe, op);
+
+        ::io_uring_free_probe(probe);
+        return supported;
+#elif defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+        io_uring_params params{};
+        auto fd = ::syscall(__NR_io_uring_setup, 1, &params);
+        if (fd < 0)
+            return false;
+
+        ::close(static_cast<int>(fd));
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    //! Replace this process with its sibling executable built for epoll
+    //
+    // Asio selects its backend at compile time, so build with io_uring
+    // falls back to epoll by running the same program built without it,
+    // i.e. run_app executes run_app_epoll. Returns only if that fails.
+    //
+    inline int exec_epoll_fallback(const char **argv)
+    {
+#ifdef __linux__
+        char self[PATH_MAX];
+        auto size = ::readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (size > 0)
+        {
+            auto path = std::string(self, size) + "_epoll";
+            ::execv(path.c_str(), const_cast<char *const *>(argv));
+        }
+#endif
+        return EXIT_FAILURE;
+    }
+
+} //namespace bae::city::beast
+#endif//INCLUDED_BAE_CITY_BEAST_IO_BACKEND_HPP
@@ -0,0 +1,140 @@
+// MIT License
+// 
+// Copyright (c) 2023 Sadhbh Code
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef INCLUDED_BAE_CITY_BEAST_MEMORY_STREAM_HPP
+#define INCLUDED_BAE_CITY_BEAST_MEMORY_STREAM_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <cstring>
+#include <string_view>
+
+
+namespace bae::city::beast {
+
+    //! In-memory duplex stream
+    //
+    // Reads drain bytes previously fed into the input, and writes append
+    // to the output, so that Service::serve() can be driven without
+    // sockets or TLS, i.e. to benchmark request parsing, handler and response
+    // serialization on a single thread.
+    //
+    // Reading from empty input completes with boost::asio::error::eof, which
+    // Boost.Beast reports as end of stream.
+    //
+    struct MemoryStream
+    {
+        using executor_type = boost::asio::any_io_executor;
+
+        explicit MemoryStream(executor_type executor)
+            : m_executor(std::move(executor)) {}
+
+        MemoryStream(const MemoryStream &) = delete;
+        MemoryStream &operator =(const MemoryStream &) = delete;
+
+        executor_type get_executor() const noexcept { return m_executor; }
+
+        //! Append bytes to be read from the stream
+        void feed(std::string_view data)
+        {
+            auto buf = m_input.prepare(data.size());
+            std::memcpy(buf.data(), data.data(), data.size());
+            m_input.commit(data.size());
+        }
+
+        //! Bytes not yet read from the stream
+        std::size_t input_size() const { return m_input.size(); }
+
+        //! Bytes written to the stream
+        std::string_view output() const
+        {
+            auto buf = m_output.data();
+            return {static_cast<const char *>(buf.data()), buf.size()};
+        }
+
+        void consume_output(std::size_t n) { m_output.consume(n); }
+        void clear_output() { m_output.clear(); }
+
+        template<typename _MutableBufferSequence, typename _ReadHandler>
+        auto async_read_some(const _MutableBufferSequence &buffers, _ReadHandler &&handler)
+        {
+            return boost::asio::async_initiate<
+                _ReadHandler, void(boost::beast::error_code, std::size_t)>(
+                    [this](auto &&handler, const _MutableBufferSequence &buffers)
+                    {
+                        boost::beast::error_code ec;
+                        std::size_t n = 0;
+
+                        if (boost::asio::buffer_size(buffers) != 0)
+                        {
+                            if (m_input.size() == 0)
+                                ec = boost::asio::error::eof;
+                            else
+                            {
+                                n = boost::asio::buffer_copy(buffers, m_input.data());
+                                m_input.consume(n);
+                            }
+                        }
+
+                        complete(std::forward<decltype(handler)>(handler), ec, n);
+                    },
+                    handler, buffers);
+        }
+
+        template<typename _ConstBufferSequence, typename _WriteHandler>
+        auto async_write_some(const _ConstBufferSequence &buffers, _WriteHandler &&handler)
+        {
+            return boost::asio::async_initiate<
+                _WriteHandler, void(boost::beast::error_code, std::size_t)>(
+                    [this](auto &&handler, const _ConstBufferSequence &buffers)
+                    {
+                        auto n = boost::asio::buffer_size(buffers);
+                        m_output.commit(boost::asio::buffer_copy(m_output.prepare(n), buffers));
+
+                        complete(std::forward<decltype(handler)>(handler), boost::beast::error_code{}, n);
+                    },
+                    handler, buffers);
+        }
+
+    private:
+        executor_type m_executor;
+        boost::beast::flat_buffer m_input;
+        boost::beast::flat_buffer m_output;
+
+        // Never invoke handler from within initiating function
+        template<typename _Handler>
+        void complete(_Handler &&handler, boost::beast::error_code ec, std::size_t n)
+        {
+            boost::asio::post(
+                m_executor,
+                boost::beast::bind_front_handler(std::forward<_Handler>(handler), ec, n));
+        }
+    };
+
+} //namespace bae::city::beast
+#endif//INCLUDED_BAE_CITY_BEAST_MEMORY_STREAM_HPP
@@ -0,0 +1,213 @@
+// MIT License
+// 
+// Copyright (c) 2023 Sadhbh Code
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef INCLUDED_BAE_CITY_BEAST_RATE_LIMITER_HPP
+#define INCLUDED_BAE_CITY_BEAST_RATE_LIMITER_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+
+namespace bae::city::beast {
+
+    struct RateLimit
+    {
+        double rate;  //< tokens refilled per second
+        double burst; //< bucket capacity
+    };
+
+    //! Lock-free table of token buckets
+    //
+    // Keys are hashed into shards of Ways slots each, and only slots of that
+    // shard are probed, so memory is bounded by capacity given at construction.
+    // When shard is full, the least recently used bucket is evicted. Evicted
+    // bucket is most likely idle, and thus full anyway. Denied requests count
+    // as use too, so that throttled bucket is never the one evicted.
+    //
+    // Bucket state (last refill time and tokens) is packed into single word,
+    // and is refilled lazily on access with compare-and-swap. Two keys may
+    // race for evicted slot, in which case they briefly share the bucket.
+    //
+    struct RateLimiter
+    {
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr std::size_t Ways = 8;
+
+        RateLimiter(RateLimit limit, std::size_t capacity = 65536)
+            : m_epoch(Clock::now())
+            , m_capacity(std::clamp<std::uint64_t>(limit.burst * One, One, TokenMask))
+            , m_refill(std::max<std::uint64_t>(limit.rate * One, 1))
+            , m_fill_ms(m_capacity * 1000 / m_refill + 1)
+            , m_shard_count(std::max<std::size_t>(1, (capacity + Ways - 1) / Ways))
+            , m_slots(m_shard_count * Ways)
+        {}
+
+        RateLimiter(const RateLimiter &) = delete;
+        RateLimiter &operator =(const RateLimiter &) = delete;
+
+        bool allow(std::string_view key, Clock::time_point now = Clock::now())
+        {
+            return allow_hash(std::hash<std::string_view>{}(key), now);
+        }
+
+        bool allow(const boost::asio::ip::address &address, Clock::time_point now = Clock::now())
+        {
+            // Salted, so that addresses do not share buckets with string keys
+            constexpr std::uint64_t salt = 0x9e3779b97f4a7c15ull;
+
+            if (address.is_v4())
+            {
+                auto bytes = address.to_v4().to_bytes();
+                return allow_hash(salt ^ std::hash<std::string_view>{}(
+                    {reinterpret_cast<const char *>(bytes.data()), bytes.size()}), now);
+            }
+
+            auto bytes = address.to_v6().to_bytes();
+            return allow_hash(salt ^ std::hash<std::string_view>{}(
+                {reinterpret_cast<const char *>(bytes.data()), bytes.size()}), now);
+        }
+
+        //! Take one token from bucket of the key, or return false if there is none
+        bool allow_hash(std::uint64_t hash, Clock::time_point now = Clock::now())
+        {
+            auto const time = elapsed_ms(now);
+            auto &slot = find(hash ? hash : 1, time);
+            slot.used.store(time, std::memory_order_relaxed);
+            auto state = slot.state.load(std::memory_order_relaxed);
+
+            for (;;)
+            {
+                auto next = refill(state, time);
+                if ((next & TokenMask) < One)
+                    return false;
+
+                if (slot.state.compare_exchange_weak(
+                        state, next - One, std::memory_order_relaxed))
+                    return true;
+            }
+        }
+
+        std::size_t capacity() const { return m_slots.size(); }
+
+    private:
+        // Tokens are fixed point numbers with 8 fractional bits stored in the
+        // low 24 bits of the state, and milliseconds since epoch in the rest.
+        static constexpr std::uint64_t One = 1 << 8;
+        static constexpr int TimeShift = 24;
+        static constexpr std::uint64_t TokenMask = (std::uint64_t{1} << TimeShift) - 1;
+
+        struct Slot
+        {
+            std::atomic<std::uint64_t> key{0};
+            std::atomic<std::uint64_t> state{0};
+            std::atomic<std::uint64_t> used{0}; //< time of last access
+        };
+
+        const Clock::time_point m_epoch;
+        const std::uint64_t m_capacity;
+        const std::uint64_t m_refill;
+        const std::uint64_t m_fill_ms;
+        const std::size_t m_shard_count;
+        std::vector<Slot> m_slots;
+
+        std::uint64_t elapsed_ms(Clock::time_point now) const
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::max(now, m_epoch) - m_epoch).count();
+        }
+
+        std::uint64_t full(std::uint64_t time) const
+        {
+            return (time << TimeShift) | m_capacity;
+        }
+
+        std::uint64_t refill(std::uint64_t state, std::uint64_t time) const
+        {
+            auto const last = state >> TimeShift;
+            auto const tokens = state & TokenMask;
+
+            if (time <= last)
+                return state;
+
+            auto const elapsed = time - last;
+            if (elapsed >= m_fill_ms)
+                return full(time);
+
+            // Keep time of last refill until at least fraction of token is due
+            auto const added = elapsed * m_refill / 1000;
+            if (added == 0)
+                return state;
+
+            return (time << TimeShift) | std::min(tokens + added, m_capacity);
+        }
+
+        Slot &find(std::uint64_t hash, std::uint64_t time)
+        {
+            auto const shard = &m_slots[(hash % m_shard_count) * Ways];
+
+            auto victim = shard;
+            auto victim_time = std::numeric_limits<std::uint64_t>::max();
+
+            for (auto slot = shard; slot != shard + Ways; ++slot)
+            {
+                auto key = slot->key.load(std::memory_order_acquire);
+                if (key == hash)
+                    return *slot;
+
+                if (key == 0)
+                {
+                    if (slot->key.compare_exchange_strong(key, hash, std::memory_order_acq_rel))
+                    {
+                        slot->state.store(full(time), std::memory_order_relaxed);
+                        return *slot;
+                    }
+                    if (key == hash)
+                        return *slot;
+                }
+
+                auto const last = slot->used.load(std::memory_order_relaxed);
+                if (last < victim_time)
+                {
+                    victim = slot;
+                    victim_time = last;
+                }
+            }
+
+            // Shard is full, so replace least recently used bucket
+            auto key = victim->key.load(std::memory_order_acquire);
+            if (key != hash && victim->key.compare_exchange_strong(key, hash, std::memory_order_acq_rel))
+                victim->state.store(full(time), std::memory_order_relaxed);
+
+            return *victim;
+        }
+    };
+
+} //namespace bae::city::beast
+#endif//INCLUDED_BAE_CITY_BEAST_RATE_LIMITER_HPP
@@ -34,12 +34,53 @@
 #include <boost/beast/version.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/config.hpp>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
+
+#if defined(BOOST_ASIO_HAS_FILE)
+#include <boost/asio/random_access_file.hpp>
+#include <memory>
+#include <unistd.h>
+#endif
 
 
 namespace bae::city::beast {
 
+    template<typename _StreamType>
+    void expires_after(_StreamType &stream, std::chrono::seconds timeout)
+    {
+        // Only streams layered on top of tcp_stream support timeouts
+        if constexpr (requires { boost::beast::get_lowest_layer(stream).expires_after(timeout); })
+            boost::beast::get_lowest_layer(stream).expires_after(timeout);
+    }
+
+    //! Remove fields which only apply to a single connection, i.e. before
+    //  passing message on to another one
+    template<typename _Fields>
+    void erase_hop_by_hop(_Fields &fields)
+    {
+        namespace http = boost::beast::http;
+
+        // Connection may name further fields of its own
+        auto const connection = std::string(fields[http::field::connection]);
+        for (auto &token : http::token_list{connection})
+            fields.erase(token);
+
+        for (auto field : {
+                 http::field::connection,
+                 http::field::keep_alive,
+                 http::field::te,
+                 http::field::upgrade,
+                 http::field::proxy_authenticate,
+                 http::field::proxy_authorization,
+                 http::field::proxy_connection})
+            fields.erase(field);
+    }
+
     template <typename _RequestType>
     struct BufferTypeTrait
     {
@@ -53,10 +94,13 @@ namespace bae::city::beast {
     template <typename _RequestType>
     struct RequestFactory
     {
-        template<LoggerConcept _LoggerType>
+        template<
+            LoggerConcept _LoggerType,
+            typename _StreamType = boost::beast::ssl_stream<boost::beast::tcp_stream>>
         struct Request
         {
             using LoggerType = _LoggerType;
+            using StreamType = _StreamType;
             using RequestType = _RequestType;
             using BufferType = typename BufferTypeTrait<RequestType>::BufferType;
 
@@ -112,6 +156,37 @@ namespace bae::city::beast {
                 return std::move(res);
             }
         
+            Response<boost::beast::http::string_body> bad_gateway(std::string why)
+            {
+                namespace http = boost::beast::http;
+
+                m_logger.error("Bad gateway: ", why);
+
+                http::response<http::string_body> res{http::status::bad_gateway, m_request.version()};
+                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                res.set(http::field::content_type, "text/html");
+                res.keep_alive(m_request.keep_alive());
+                res.body() = "Upstream error: '" + why + "'";
+                res.prepare_payload();
+
+                return std::move(res);
+            }
+
+            Response<boost::beast::http::empty_body> too_many_requests()
+            {
+                namespace http = boost::beast::http;
+
+                // Not logged, as these are expected to come in floods
+
+                http::response<http::empty_body> res{http::status::too_many_requests, m_request.version()};
+                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                res.set(http::field::retry_after, "1");
+                res.content_length(0);
+                res.keep_alive(m_request.keep_alive());
+
+                return std::move(res);
+            }
+        
             Response<boost::beast::http::empty_body> success()
             {
                 namespace http = boost::beast::http;
@@ -143,7 +218,7 @@ namespace bae::city::beast {
                 return std::move(res);
             }
 
-            Response<FileBody> file_response(FileBody &&body, std::string mime_type)
+            Response<FileBody> file_response(FileBody::value_type &&body, std::string mime_type)
             {
                 namespace http = boost::beast::http;
                 
@@ -158,13 +233,242 @@ namespace bae::city::beast {
                 res.content_length(res.body().size());
                 res.keep_alive(m_request.keep_alive());
 
-                return std::move(m_request);
+                return std::move(res);
+            }
+
+            Response<boost::beast::http::empty_body> not_modified(std::string etag, std::string last_modified)
+            {
+                namespace http = boost::beast::http;
+
+                m_logger.info("Not modified");
+
+                http::response<http::empty_body> res{http::status::not_modified, m_request.version()};
+                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                if (!etag.empty())
+                    res.set(http::field::etag, std::move(etag));
+                if (!last_modified.empty())
+                    res.set(http::field::last_modified, std::move(last_modified));
+                res.keep_alive(m_request.keep_alive());
+
+                return std::move(res);
+            }
+
+            Response<boost::beast::http::empty_body> range_not_satisfiable(std::uint64_t size)
+            {
+                namespace http = boost::beast::http;
+
+                m_logger.error("Range not satisfiable: ", m_request[http::field::range]);
+
+                http::response<http::empty_body> res{http::status::range_not_satisfiable, m_request.version()};
+                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                res.set(http::field::content_range, "bytes */" + std::to_string(size));
+                res.content_length(0);
+                res.keep_alive(m_request.keep_alive());
+
+                return std::move(res);
+            }
+
+            //! Response written piece by piece, see open_response()
+            struct ResponseWriter
+            {
+                ResponseWriter(
+                    Request &request,
+                    std::string mime_type,
+                    std::optional<std::uint64_t> content_length)
+                    : m_request(request)
+                    , m_content_length(content_length)
+                    , m_head(request.m_request.method() == boost::beast::http::verb::head)
+                {
+                    namespace http = boost::beast::http;
+
+                    m_response.result(http::status::ok);
+                    m_response.version(request.m_request.version());
+                    m_response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                    m_response.set(http::field::content_type, mime_type);
+                    m_response.keep_alive(request.m_request.keep_alive());
+
+                    if (content_length)
+                        m_response.content_length(*content_length);
+                    else if (request.m_request.version() >= 11)
+                        m_response.chunked(m_chunked = true);
+                    else if (!m_head)
+                        // HTTP/1.0 knows no chunks, so that body ends with connection
+                        m_response.keep_alive(false);
+                }
+
+                ResponseWriter(const ResponseWriter &) = delete;
+                ResponseWriter &operator =(const ResponseWriter &) = delete;
+
+                ~ResponseWriter()
+                {
+                    // Response is incomplete, so client cannot tell where next one starts
+                    if (!m_finished)
+                        m_request.m_close = true;
+                }
+
+                //! Header can be modified until first write
+                Response<boost::beast::http::empty_body> &header() { return m_response; }
+
+                //! Write piece of body, and resume when stream has taken it
+                //
+                // Data is written straight from the buffer given, which needs to
+                // outlive this call only.
+                //
+                bool write(std::string_view data)
+                {
+                    // Response to HEAD is header only, and data is dropped
+                    if (!write_header() || data.empty() || m_head)
+                        return !m_request.m_ec;
+
+                    // Long-lived streams are only timed out while stuck writing
+                    expires_after(m_request.m_stream, std::chrono::seconds(30));
+
+                    if (m_content_length)
+                    {
+                        if (data.size() > *m_content_length - m_written)
+                        {
+                            m_request.m_close = true;
+                            m_request.m_ec = boost::beast::http::error::body_limit;
+                            return false;
+                        }
+
+                        boost::asio::async_write(
+                            m_request.m_stream,
+                            boost::asio::buffer(data.data(), data.size()),
+                            m_request.m_yield[m_request.m_ec]);
+                    }
+                    else if (m_chunked)
+                    {
+                        boost::asio::async_write(
+                            m_request.m_stream,
+                            boost::beast::http::make_chunk(boost::asio::buffer(data.data(), data.size())),
+                            m_request.m_yield[m_request.m_ec]);
+                    }
+                    else
+                    {
+                        boost::asio::async_write(
+                            m_request.m_stream,
+                            boost::asio::buffer(data.data(), data.size()),
+                            m_request.m_yield[m_request.m_ec]);
+                    }
+
+                    m_written += data.size();
+                    return !m_request.m_ec;
+                }
+
+                //! Write Server-Sent Event, i.e. for "text/event-stream" response
+                bool write_event(std::string_view data, std::string_view event = {})
+                {
+                    std::string message;
+                    message.reserve(data.size() + event.size() + 16);
+
+                    if (!event.empty())
+                        message.append("event: ").append(event).append("\n");
+
+                    for (std::size_t pos = 0; pos <= data.size();)
+                    {
+                        auto end = std::min(data.find('\n', pos), data.size());
+                        message.append("data: ").append(data.substr(pos, end - pos)).append("\n");
+                        pos = end + 1;
+                    }
+                    message.append("\n");
+
+                    return write(message);
+                }
+
+                //! Complete the response
+                bool finish()
+                {
+                    if (m_finished)
+                        return !m_request.m_ec;
+
+                    m_finished = true;
+
+                    if (!write_header())
+                        return false;
+
+                    if (m_head)
+                        return true;
+
+                    if (m_content_length)
+                    {
+                        // Client would wait for the rest of the body forever
+                        if (m_written != *m_content_length)
+                        {
+                            m_request.m_close = true;
+                            m_request.m_ec = boost::beast::http::error::partial_message;
+                            return false;
+                        }
+
+                        return true;
+                    }
+
+                    if (!m_chunked)
+                        return true;
+
+                    expires_after(m_request.m_stream, std::chrono::seconds(30));
+                    boost::asio::async_write(
+                        m_request.m_stream,
+                        boost::beast::http::make_chunk_last(),
+                        m_request.m_yield[m_request.m_ec]);
+
+                    return !m_request.m_ec;
+                }
+
+                std::uint64_t written() const { return m_written; }
+
+            private:
+                Request &m_request;
+                Response<boost::beast::http::empty_body> m_response;
+                std::optional<std::uint64_t> m_content_length;
+                std::uint64_t m_written = 0;
+                const bool m_head;
+                bool m_chunked = false;
+                bool m_header_written = false;
+                bool m_finished = false;
+
+                bool write_header()
+                {
+                    namespace http = boost::beast::http;
+
+                    if (m_request.m_ec)
+                        return false;
+
+                    if (m_header_written)
+                        return true;
+
+                    m_header_written = true;
+                    m_request.m_close = m_response.need_eof();
+
+                    http::response_serializer<http::empty_body> s{m_response};
+                    expires_after(m_request.m_stream, std::chrono::seconds(30));
+                    http::async_write_header(m_request.m_stream, s, m_request.m_yield[m_request.m_ec]);
+
+                    return !m_request.m_ec;
+                }
+            };
+
+            //! Open response, which is then written piece by piece
+            //
+            // Without content length, chunked transfer encoding is used, or for
+            // HTTP/1.0 clients the body ends by closing connection. Response to
+            // HEAD request gets the header only. Each write resumes the handler
+            // once the stream has taken the data, so slow clients hold back the
+            // handler instead of buffered data.
+            //
+            ResponseWriter open_response(
+                std::string mime_type,
+                std::optional<std::uint64_t> content_length = std::nullopt)
+            {
+                m_logger.info("Ok: Stream <", mime_type, ">");
+
+                return ResponseWriter{*this, std::move(mime_type), content_length};
             }
 
             Request(
                 RequestType &&request,
                 LoggerType &logger,
-                boost::beast::ssl_stream<boost::beast::tcp_stream> &stream,
+                StreamType &stream,
                 bool &close,
                 boost::beast::error_code &ec,
                 boost::asio::yield_context yield)
@@ -190,6 +494,142 @@ namespace bae::city::beast {
                 boost::beast::http::async_write(m_stream, s, m_yield[m_ec]);
             }
 
+#if defined(BOOST_ASIO_HAS_FILE)
+            //! Send file response, reading the file asynchronously
+            //
+            // Beast reads file_body with blocking read() during serialization,
+            // whereas with io_uring backend Asio can read files as well as it
+            // writes sockets, without blocking the thread.
+            //
+            void send(Response<FileBody> &&msg)
+            {
+                namespace http = boost::beast::http;
+
+                m_close = msg.need_eof();
+
+                auto const size = msg.body().size();
+                auto const fd = ::dup(msg.body().file().native_handle());
+                if (fd < 0)
+                {
+                    m_ec = {errno, boost::system::system_category()};
+                    return;
+                }
+
+                boost::asio::random_access_file file{m_stream.get_executor(), fd};
+
+                Response<http::empty_body> header{std::move(msg.base())};
+                http::response_serializer<http::empty_body> s{header};
+                http::async_write_header(m_stream, s, m_yield[m_ec]);
+                if (m_ec)
+                    return;
+
+                // Larger than for sockets, as each read is a request to io_uring
+                constexpr std::size_t BufferSize = 65536;
+                auto const buf = std::make_unique<char[]>(BufferSize);
+
+                boost::beast::error_code ec;
+                for (std::uint64_t offset = 0; offset < size;)
+                {
+                    auto const n = file.async_read_some_at(
+                        offset,
+                        boost::asio::buffer(buf.get(), std::min<std::uint64_t>(BufferSize, size - offset)),
+                        m_yield[ec]);
+                    if (ec)
+                    {
+                        // Response is cut short, so client cannot tell where next one starts
+                        m_close = true;
+                        m_ec = ec;
+                        return;
+                    }
+
+                    boost::asio::async_write(m_stream, boost::asio::buffer(buf.get(), n), m_yield[m_ec]);
+                    if (m_ec)
+                        return;
+
+                    offset += n;
+                }
+            }
+#endif
+
+            //! Send response read from upstream, relaying its body as it arrives
+            //
+            // The header must have been read into the parser already. Errors
+            // reading from upstream are reported via upstream_ec, and as part
+            // of response might have been sent, connection is then closed.
+            //
+            // Response is framed for the client, i.e. HTTP/1.0 client gets body
+            // delimited by closing connection instead of chunks. Each read and
+            // write is timed out on its own, so that long responses are fine
+            // as long as data keeps flowing.
+            //
+            template<typename _UpstreamStream, typename _UpstreamBuffer>
+            void
+            relay(
+                boost::beast::http::response_parser<boost::beast::http::buffer_body> &parser,
+                _UpstreamStream &upstream,
+                _UpstreamBuffer &upstream_buffer,
+                boost::beast::error_code &upstream_ec)
+            {
+                namespace http = boost::beast::http;
+
+                auto &res = parser.get();
+                erase_hop_by_hop(res);
+                res.version(m_request.version());
+                res.keep_alive(m_request.keep_alive());
+
+                // HTTP/1.0 knows no chunks, so that body ends with connection
+                if (m_request.version() < 11 && res.chunked())
+                {
+                    res.chunked(false);
+                    res.keep_alive(false);
+                }
+                m_close = res.need_eof();
+
+                http::serializer<false, http::buffer_body> s{res};
+                expires_after(m_stream, std::chrono::seconds(30));
+                http::async_write_header(m_stream, s, m_yield[m_ec]);
+                if (m_ec)
+                    return;
+
+                char buf[8192];
+                do
+                {
+                    if (!parser.is_done())
+                    {
+                        res.body().data = buf;
+                        res.body().size = sizeof(buf);
+                        expires_after(upstream, std::chrono::seconds(30));
+                        http::async_read(upstream, upstream_buffer, parser, m_yield[upstream_ec]);
+                        if (upstream_ec == http::error::need_buffer)
+                            upstream_ec = {};
+                        if (upstream_ec)
+                        {
+                            m_close = true;
+                            return;
+                        }
+                        res.body().size = sizeof(buf) - res.body().size;
+                        res.body().data = buf;
+                        res.body().more = !parser.is_done();
+                    }
+                    else
+                    {
+                        res.body().data = nullptr;
+                        res.body().size = 0;
+                    }
+
+                    expires_after(m_stream, std::chrono::seconds(30));
+                    http::async_write(m_stream, s, m_yield[m_ec]);
+                    if (m_ec == http::error::need_buffer)
+                        m_ec = {};
+                    if (m_ec)
+                        return;
+                }
+                while (!parser.is_done() && !s.is_done());
+            }
+
+            boost::asio::yield_context yield() const { return m_yield; }
+            auto get_executor() { return m_stream.get_executor(); }
+
             RequestType &request() { return m_request; }
             RequestType *operator->() { return &m_request; }
             RequestType &operator*() { return m_request; }
@@ -199,7 +639,7 @@ namespace bae::city::beast {
         private:
             RequestType m_request;
             LoggerType &m_logger;
-            boost::beast::ssl_stream<boost::beast::tcp_stream> &m_stream;
+            StreamType &m_stream;
             bool &m_close;
             boost::beast::error_code &m_ec;
             boost::asio::yield_context m_yield;
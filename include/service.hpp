@@ -27,12 +27,20 @@
 #define INCLUDED_BAE_CITY_BEAST_SERVICE_HPP
 
 #include "concepts.hpp"
+#include "io_backend.hpp"
+#include "rate_limiter.hpp"
 #include "request.hpp"
+#include "service_config.hpp"
+
+#include <boost/asio/local/stream_protocol.hpp>
 
 #include <algorithm>
 #include <cstdlib>
+#include <filesystem>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -50,6 +58,9 @@ namespace bae::city::beast {
         using LoggerType = _LoggerType;
         using RequestType = typename _RequestFactory::Request<LoggerType>;
 
+        template<typename _StreamType>
+        using RequestTypeFor = typename _RequestFactory::template Request<LoggerType, _StreamType>;
+
         Service(LoggerType &logger, Server &server)
             : m_logger(logger)
             , m_server(server) {}
@@ -57,6 +68,32 @@ namespace bae::city::beast {
         Service(const Service &) = delete;
         Service &operator =(const Service &) = delete;
 
+        //! Limit rate of connections accepted from each remote address
+        //
+        // Rejected connections are closed straight away, without TLS handshake.
+        // Listeners can opt out with ListenerConfig::rate_limited.
+        //
+        void limit_connections(RateLimiter &limiter) { m_connection_limiter = &limiter; }
+
+        //! Verifies credential of request, and returns identity of the client
+        using CredentialVerifier = std::function<
+            std::optional<std::string>(const typename RequestType::RequestType &)>;
+
+        //! Limit rate of requests for each client identity or remote address
+        //
+        // Requests are limited per identity returned by verify, and others per
+        // remote address. Credentials are never trusted without verification,
+        // as clients could otherwise get fresh bucket by making them up.
+        // Rejected requests get 429 response, and never reach the server.
+        // Listeners can opt out with ListenerConfig::rate_limited, i.e. local
+        // ones do by default, as all their peers would share single bucket.
+        //
+        void limit_requests(RateLimiter &limiter, CredentialVerifier verify = {})
+        {
+            m_request_limiter = &limiter;
+            m_verify_credential = std::move(verify);
+        }
+
         template<ServiceConfigConcept _ServiceConfig>
         int operator()(_ServiceConfig &&config)
         {
@@ -65,15 +102,13 @@ namespace bae::city::beast {
 
             config.configure(ctx);
 
-            m_logger.info("Listening on ", config.address(), ":", config.port());
+            m_logger.info("Using ", io_backend_name(), " backend");
 
-            boost::asio::spawn(
-                ioc, [this, &ioc, &ctx, &config](auto &&arg)
-                { do_listen(
-                      ioc,
-                      ctx,
-                      boost::asio::ip::tcp::endpoint{config.address(), config.port()},
-                      std::forward<decltype(arg)>(arg)); });
+            for (auto &listener : config.listeners())
+            {
+                if (listen(ioc, ctx, listener))
+                    return EXIT_FAILURE;
+            }
 
             std::vector<std::thread> v;
             v.reserve(config.thread_count() - 1);
@@ -88,117 +123,376 @@ namespace bae::city::beast {
             return EXIT_SUCCESS;
         }
 
+        //! Start accepting connections of the listener
+        //
+        // Acceptor is set up straight away, and connections are then accepted
+        // by coroutine running on the io_context, until it is stopped. Both
+        // contexts and the listener need to outlive it.
+        //
+        // Returns error if acceptor could not be set up, i.e. when address is
+        // in use.
+        //
+        boost::beast::error_code
+        listen(
+            boost::asio::io_context& ioc,
+            boost::asio::ssl::context& ctx,
+            const ListenerConfig& listener)
+        {
+            if (listener.is_local())
+            {
+                m_logger.info("Listening on ", listener.path, (listener.tls ? " (TLS)" : ""));
+
+                return do_listen(
+                    ioc, ctx, listener,
+                    boost::asio::local::stream_protocol::endpoint{listener.path});
+            }
+
+            m_logger.info("Listening on ", listener.address, ":", listener.port, (listener.tls ? " (TLS)" : ""));
+
+            return do_listen(
+                ioc, ctx, listener,
+                boost::asio::ip::tcp::endpoint{listener.address, listener.port});
+        }
+
+        //! Serve requests over already established stream
+        //
+        // Transport setup and teardown (i.e. SSL handshake and shutdown) is up
+        // to the caller, so that any stream can be used, e.g. MemoryStream.
+        //
+        // Returns false if the stream failed, and true if the peer finished
+        // or the response asked to close the connection.
+        //
+        // Requests are rate limited by request limiter, if any, unless
+        // rate_limited is false.
+        //
+        template<typename _StreamType>
+        bool
+        serve(
+            _StreamType& stream,
+            boost::asio::yield_context yield,
+            bool rate_limited = true)
+        {
+            using StreamRequestType = RequestTypeFor<_StreamType>;
+
+            bool close = false;
+            boost::beast::error_code ec;
+        
+            typename StreamRequestType::BufferType buffer;
+
+            auto const peer = remote_address(stream);
+
+            for(;;)
+            {
+                // Set the timeout.
+                expires_after(stream, std::chrono::seconds(30));
+        
+                typename StreamRequestType::RequestType req;
+        
+                // Read a request
+                boost::beast::http::async_read(stream, buffer, req, yield[ec]);
+                if(ec == boost::beast::http::error::end_of_stream)
+                    break;
+                if(ec)
+                {
+                    fail(ec, "read");
+                    return false;
+                }
+                
+                // Send the response
+                StreamRequestType request{std::move(req), m_logger, stream, close, ec, yield};
+                if (!rate_limited || allow_request(request, peer))
+                    m_server(request);
+                else
+                    request.send(request.too_many_requests());
+
+                if(ec)
+                {
+                    fail(ec, "write");
+                    return false;
+                }
+                if(close)
+                {
+                    // This means we should close the connection, usually because
+                    // the response indicated the "Connection: close" semantic.
+                    break;
+                }
+            }
+
+            return true;
+        }
+
     private:
         LoggerType &m_logger;
         Server &m_server;
+        RateLimiter *m_connection_limiter = nullptr;
+        RateLimiter *m_request_limiter = nullptr;
+        CredentialVerifier m_verify_credential;
 
-        void
+        template<typename _Endpoint>
+        boost::beast::error_code
         do_listen(
             boost::asio::io_context& ioc,
             boost::asio::ssl::context& ctx,
-            boost::asio::ip::tcp::endpoint endpoint,
-            boost::asio::yield_context yield)
+            const ListenerConfig& listener,
+            _Endpoint endpoint)
         {
+            using Protocol = typename _Endpoint::protocol_type;
+
+            constexpr bool is_tcp = std::is_same_v<Protocol, boost::asio::ip::tcp>;
+
             boost::beast::error_code ec;
+            auto failed = [&](char const *what)
+            {
+                fail(ec, what);
+                return ec;
+            };
+
+            // Remove socket file left behind by previous run, but not one that
+            // running instance still accepts connections on
+            if constexpr (!is_tcp)
+            {
+                std::error_code fs_ec;
+                if (std::filesystem::is_socket(listener.path, fs_ec))
+                {
+                    typename Protocol::socket probe(ioc);
+                    probe.connect(endpoint, ec);
+                    if (!ec)
+                    {
+                        ec = boost::asio::error::address_in_use;
+                        return failed("bind");
+                    }
+
+                    std::filesystem::remove(listener.path, fs_ec);
+                }
+            }
 
             // Open the acceptor
-            boost::asio::ip::tcp::acceptor acceptor(ioc);
+            boost::asio::basic_socket_acceptor<Protocol> acceptor(ioc);
             acceptor.open(endpoint.protocol(), ec);
             if (ec)
-                return fail(ec, "open");
+                return failed("open");
 
-            // Allow address reuse
-            acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
-            if (ec)
-                return fail(ec, "set_option");
+            if constexpr (is_tcp)
+            {
+                // Allow address reuse
+                acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
+                if (ec)
+                    return failed("set_option");
+
+#ifdef TCP_DEFER_ACCEPT
+                // Wake up only once client has sent some data
+                if (listener.defer_accept)
+                {
+                    acceptor.set_option(
+                        boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>(
+                            *listener.defer_accept), ec);
+                    if (ec)
+                        return failed("set_option");
+                }
+#endif
+            }
+
+            // Accepted sockets inherit buffer sizes, which need to be set before
+            // listening for TCP window scaling to take them into account
+            if (listener.receive_buffer_size)
+            {
+                acceptor.set_option(
+                    boost::asio::socket_base::receive_buffer_size(*listener.receive_buffer_size), ec);
+                if (ec)
+                    return failed("set_option");
+            }
+
+            if (listener.send_buffer_size)
+            {
+                acceptor.set_option(
+                    boost::asio::socket_base::send_buffer_size(*listener.send_buffer_size), ec);
+                if (ec)
+                    return failed("set_option");
+            }
 
             // Bind to the server address
             acceptor.bind(endpoint, ec);
             if (ec)
-                return fail(ec, "bind");
+                return failed("bind");
 
             // Start listening for connections
-            acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+            acceptor.listen(listener.backlog, ec);
             if (ec)
-                return fail(ec, "listen");
+                return failed("listen");
+
+            boost::asio::spawn(
+                ioc, [this, &ioc, &ctx, &listener, acceptor = std::move(acceptor)](auto &&arg) mutable
+                { do_accept(
+                      ioc,
+                      ctx,
+                      listener,
+                      acceptor,
+                      std::forward<decltype(arg)>(arg)); });
+
+            return {};
+        }
+
+        template<typename _Protocol>
+        void
+        do_accept(
+            boost::asio::io_context& ioc,
+            boost::asio::ssl::context& ctx,
+            const ListenerConfig& listener,
+            boost::asio::basic_socket_acceptor<_Protocol>& acceptor,
+            boost::asio::yield_context yield)
+        {
+            using Stream = boost::beast::basic_stream<_Protocol>;
+
+            constexpr bool is_tcp = std::is_same_v<_Protocol, boost::asio::ip::tcp>;
+
+            boost::beast::error_code ec;
 
             for (;;)
             {
-                boost::asio::ip::tcp::socket socket(ioc);
+                typename _Protocol::socket socket(ioc);
                 acceptor.async_accept(socket, yield[ec]);
                 if (ec)
+                {
                     fail(ec, "accept");
-                else
+                    continue;
+                }
+
+                if constexpr (is_tcp)
+                {
+                    if (listener.rate_limited && !allow_connection(socket))
+                    {
+                        socket.close(ec);
+                        continue;
+                    }
+
+                    if (listener.no_delay)
+                        socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+                }
+
+                if (listener.tls)
                 {
                     boost::asio::spawn(
                         acceptor.get_executor(),
                         std::bind(
-                            &Service::do_session,
+                            &Service::do_session<boost::beast::ssl_stream<Stream>>,
                             this,
-                            boost::beast::ssl_stream<boost::beast::tcp_stream>(
+                            boost::beast::ssl_stream<Stream>(
                                 std::move(socket), ctx),
+                            listener.rate_limited,
+                            std::placeholders::_1));
+                }
+                else
+                {
+                    boost::asio::spawn(
+                        acceptor.get_executor(),
+                        std::bind(
+                            &Service::do_session<Stream>,
+                            this,
+                            Stream(std::move(socket)),
+                            listener.rate_limited,
                             std::placeholders::_1));
                 }
             }
         }
 
+        template<typename _StreamType>
         void
         do_session(
-            boost::beast::ssl_stream<boost::beast::tcp_stream>& stream,
+            _StreamType& stream,
+            bool rate_limited,
             boost::asio::yield_context yield)
         {
-            bool close = false;
+            constexpr bool is_ssl = requires { stream.async_handshake(boost::asio::ssl::stream_base::server, yield); };
+
             boost::beast::error_code ec;
         
-            // Set the timeout.
-            boost::beast::get_lowest_layer(stream).expires_after(std::chrono::seconds(30));
-        
-            // Perform the SSL handshake
-            stream.async_handshake(boost::asio::ssl::stream_base::server, yield[ec]);
-            if(ec)
-                return fail(ec, "handshake");
-        
-            typename RequestType::BufferType buffer;
-
-            for(;;)
+            if constexpr (is_ssl)
             {
                 // Set the timeout.
-                boost::beast::get_lowest_layer(stream).expires_after(std::chrono::seconds(30));
-        
-                typename RequestType::RequestType req;
+                expires_after(stream, std::chrono::seconds(30));
         
-                // Read a request
-                boost::beast::http::async_read(stream, buffer, req, yield[ec]);
-                if(ec == boost::beast::http::error::end_of_stream)
-                    break;
-                if(ec)
-                    return fail(ec, "read");
-                
-                // Send the response
-                RequestType request{std::move(req), m_logger, stream, close, ec, yield};
-                m_server(request);
-
+                // Perform the SSL handshake
+                stream.async_handshake(boost::asio::ssl::stream_base::server, yield[ec]);
                 if(ec)
-                    return fail(ec, "write");
-                if(close)
-                {
-                    // This means we should close the connection, usually because
-                    // the response indicated the "Connection: close" semantic.
-                    break;
-                }
+                    return fail(ec, "handshake");
             }
         
-            // Set the timeout.
-            boost::beast::get_lowest_layer(stream).expires_after(std::chrono::seconds(30));
+            if (!serve(stream, yield, rate_limited))
+                return;
+        
+            if constexpr (is_ssl)
+            {
+                // Set the timeout.
+                expires_after(stream, std::chrono::seconds(30));
         
-            // Perform the SSL shutdown
-            stream.async_shutdown(yield[ec]);
-            if(ec)
-                return fail(ec, "shutdown");
+                // Perform the SSL shutdown
+                stream.async_shutdown(yield[ec]);
+                if(ec)
+                    return fail(ec, "shutdown");
+            }
+            else
+            {
+                // Send a TCP shutdown
+                stream.socket().shutdown(boost::asio::socket_base::shutdown_send, ec);
+            }
         
             // At this point the connection is closed gracefully
         }
 
+        bool
+        allow_connection(boost::asio::ip::tcp::socket &socket)
+        {
+            if (!m_connection_limiter)
+                return true;
+
+            boost::beast::error_code ec;
+            auto endpoint = socket.remote_endpoint(ec);
+            if (ec)
+                return false;
+
+            return m_connection_limiter->allow(endpoint.address());
+        }
+
+        template<typename _Request>
+        bool
+        allow_request(
+            _Request &request,
+            const std::optional<boost::asio::ip::address> &peer)
+        {
+            if (!m_request_limiter)
+                return true;
+
+            if (m_verify_credential)
+            {
+                if (auto identity = m_verify_credential(request.request()))
+                    return m_request_limiter->allow(*identity);
+            }
+
+            // Anonymous requests over streams without address share one bucket
+            if (!peer)
+                return m_request_limiter->allow(std::string_view{});
+
+            return m_request_limiter->allow(*peer);
+        }
+
+        template<typename _StreamType>
+        std::optional<boost::asio::ip::address>
+        remote_address(_StreamType &stream)
+        {
+            if constexpr (requires { boost::beast::get_lowest_layer(stream).socket().remote_endpoint().address(); })
+            {
+                if (!m_request_limiter)
+                    return std::nullopt;
+
+                boost::beast::error_code ec;
+                auto endpoint = boost::beast::get_lowest_layer(stream).socket().remote_endpoint(ec);
+                if (!ec)
+                    return endpoint.address();
+            }
+
+            return std::nullopt;
+        }
+
         void
         fail(boost::beast::error_code ec, char const *what)
         {
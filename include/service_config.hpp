@@ -24,31 +24,85 @@
 #define INCLUDED_BAE_CITY_BEAST_SERVICE_CONFIG_HPP
 
 #include <boost/asio/ip/address.hpp>
+#include <boost/asio/socket_base.hpp>
+#include <optional>
 #include <string>
+#include <vector>
 
 
 namespace bae::city::beast {
 
-    struct ServiceConfig
+    struct ListenerConfig
     {
         using Address = boost::asio::ip::address;
         using Port = unsigned short;
 
+        //! Listen on TCP address, either IPv4 or IPv6
+        static ListenerConfig tcp(Address address, Port port, bool tls = true)
+        {
+            ListenerConfig listener;
+            listener.address = std::move(address);
+            listener.port = port;
+            listener.tls = tls;
+            return listener;
+        }
+
+        static ListenerConfig tcp(const std::string &address, Port port, bool tls = true)
+        {
+            return tcp(boost::asio::ip::make_address(address), port, tls);
+        }
+
+        //! Listen on Unix domain socket, i.e. for sidecars on the same host
+        static ListenerConfig local(std::string path, bool tls = false)
+        {
+            ListenerConfig listener;
+            listener.path = std::move(path);
+            listener.tls = tls;
+            listener.rate_limited = false;
+            return listener;
+        }
+
+        bool is_local() const { return !path.empty(); }
+
+        Address address;
+        Port port = 0;
+        std::string path;   //< of Unix domain socket, if not empty
+        bool tls = true;
+        bool rate_limited = true;   //< by limiters of the service, off for local peers having no address
+
+        int backlog = boost::asio::socket_base::max_listen_connections;
+        bool no_delay = false;                      //< TCP_NODELAY
+        std::optional<int> defer_accept;            //< TCP_DEFER_ACCEPT in seconds, Linux only
+        std::optional<int> receive_buffer_size;     //< SO_RCVBUF
+        std::optional<int> send_buffer_size;        //< SO_SNDBUF
+    };
+
+    struct ServiceConfig
+    {
+        using Address = ListenerConfig::Address;
+        using Port = ListenerConfig::Port;
+
         ServiceConfig(const std::string &address, Port port, int thread_count)
-            : m_address(boost::asio::ip::make_address(address)), m_port(port), m_thread_count(thread_count)
+            : m_listeners{ListenerConfig::tcp(address, port)}, m_thread_count(thread_count)
         {}
 
         ServiceConfig(Address address, Port port, int thread_count)
-            : m_address(std::move(address)), m_port(port), m_thread_count(thread_count)
+            : m_listeners{ListenerConfig::tcp(std::move(address), port)}, m_thread_count(thread_count)
         {}
 
-    const Address &address() const { return m_address; }
-    const Port &port() const { return m_port; }
+        ServiceConfig(std::vector<ListenerConfig> listeners, int thread_count)
+            : m_listeners(std::move(listeners)), m_thread_count(thread_count)
+        {}
+
+    //! Address and port of the first listener
+    const Address &address() const { return m_listeners.front().address; }
+    const Port &port() const { return m_listeners.front().port; }
+
+    const std::vector<ListenerConfig> &listeners() const { return m_listeners; }
     const int thread_count() const { return m_thread_count; }
 
     private:
-        const Address m_address;
-        const Port m_port;
+        const std::vector<ListenerConfig> m_listeners;
         const int m_thread_count;
     };
 
@@ -0,0 +1,504 @@
+// MIT License
+// 
+// Copyright (c) 2023 Sadhbh Code
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef INCLUDED_BAE_CITY_BEAST_UPSTREAM_HPP
+#define INCLUDED_BAE_CITY_BEAST_UPSTREAM_HPP
+
+#include "concepts.hpp"
+#include "request.hpp"
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+
+namespace bae::city::beast {
+
+    struct UpstreamConfig
+    {
+        std::string host;
+        std::string port;
+        std::size_t max_connections = 64;   //< open connections, both idle and in use, others wait for one
+        std::size_t max_idle = 16;          //< connections kept for reuse
+        std::chrono::seconds idle_timeout{30};
+        std::chrono::seconds timeout{30};   //< until response header arrives, body is timed out per read
+        std::size_t max_failures = 5;       //< consecutive, before upstream is marked down
+        std::chrono::seconds retry_after{5};//< for upstream marked down
+    };
+
+    struct UpstreamStats
+    {
+        std::uint64_t requests;
+        std::uint64_t responses;    //< response headers received from upstream
+        std::uint64_t reused;       //< requests sent over pooled connection
+        std::uint64_t connected;    //< requests sent over new connection
+        std::uint64_t failures;
+        std::uint64_t latency_ns;   //< total time until response header arrived
+
+        double hit_rate() const
+        {
+            return (reused + connected) ? double(reused) / (reused + connected) : 0.0;
+        }
+
+        double mean_latency_ns() const
+        {
+            return responses ? double(latency_ns) / responses : 0.0;
+        }
+    };
+
+    //! Forwards requests to upstream HTTP server over pool of keep-alive connections
+    //
+    // Use from within ServerConcept handler:
+    //
+    //  return m_upstream.forward(request);
+    //
+    // Upstream I/O runs on the coroutine of the request, so it shares
+    // io_context threads with the service. Response body is relayed to the
+    // client as it arrives, without buffering it in full. Request body is
+    // not, as service reads whole request before any handler runs, so that
+    // it is limited by the body limit of request type.
+    //
+    // Idle connections are checked before reuse, and if reused connection
+    // fails before response arrives, request is retried over new connection.
+    // That is unless request might have reached upstream, and is not
+    // idempotent. Upstream failing repeatedly is marked down for a while,
+    // during which requests are answered with 502 straight away.
+    //
+    // Requests above max_connections wait in line for connection to be
+    // released, for up to timeout.
+    //
+    struct Upstream
+    {
+        using Clock = std::chrono::steady_clock;
+
+        explicit Upstream(UpstreamConfig config)
+            : m_config(std::move(config)) {}
+
+        Upstream(const Upstream &) = delete;
+        Upstream &operator =(const Upstream &) = delete;
+
+        void forward(RequestConcept auto &request)
+        {
+            namespace http = boost::beast::http;
+
+            auto yield = request.yield();
+            auto const started = Clock::now();
+
+            ++m_requests;
+
+            if (!healthy(started))
+            {
+                ++m_failures;
+                return request.send(request.bad_gateway("Upstream is down"));
+            }
+
+            boost::beast::error_code ec;
+
+            for (int attempt = 0; attempt != 2; ++attempt)
+            {
+                auto conn = acquire(request.get_executor(), yield, ec);
+                if (ec == boost::asio::error::try_again)
+                {
+                    // Waiting for own pool says nothing about health of upstream
+                    ++m_failures;
+                    return request.send(request.bad_gateway("Upstream connection pool is exhausted"));
+                }
+                if (!conn)
+                    break;
+
+                http::response_parser<http::buffer_body> parser;
+                // Not boost::none, which Beast 1.74 compares as less than any length
+                parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+                parser.skip(request->method() == http::verb::head);
+
+                send(request.request(), *conn, yield, ec);
+                bool const written = !ec;
+                if (!ec)
+                    http::async_read_header(conn->stream, conn->buffer, parser, yield[ec]);
+                if (!ec)
+                    return relay(request, parser, std::move(*conn), started);
+
+                bool const reused = conn->reused;
+                release(std::move(*conn), false);
+
+                // Pooled connection might have been closed by upstream meanwhile,
+                // but once request was written, upstream might have acted on it
+                // too, so that only idempotent requests can be sent again
+                if (!reused || (written && !is_idempotent(request->method())))
+                    break;
+            }
+
+            failed(Clock::now());
+            return request.send(request.bad_gateway(ec.message()));
+        }
+
+        UpstreamStats stats() const
+        {
+            return {
+                m_requests.load(), m_responses.load(), m_reused.load(),
+                m_connected.load(), m_failures.load(), m_latency_ns.load()};
+        }
+
+        const UpstreamConfig &config() const { return m_config; }
+
+        //! Close pooled connections, i.e. before stopping io_context
+        void close_idle()
+        {
+            std::lock_guard lock{m_mutex};
+
+            for (auto &conn : m_idle)
+            {
+                close(conn.stream);
+                free_slot();
+            }
+
+            m_idle.clear();
+        }
+
+    private:
+        struct Connection
+        {
+            boost::beast::tcp_stream stream;
+            boost::beast::flat_buffer buffer;
+            Clock::time_point idle_since;
+            bool reused = false;
+        };
+
+        //! Request waiting in line for connection
+        struct Waiter
+        {
+            std::optional<Connection> conn;  //< released connection handed over
+            bool slot = false;               //< or slot to open new connection
+
+            boost::asio::any_io_executor executor;      //< strand of waiting coroutine
+            std::shared_ptr<boost::asio::steady_timer> timer;
+        };
+
+        const UpstreamConfig m_config;
+
+        std::mutex m_mutex;
+        std::vector<Connection> m_idle;
+        std::deque<std::shared_ptr<Waiter>> m_waiters;
+        std::size_t m_open = 0;
+        std::optional<boost::asio::ip::tcp::resolver::results_type> m_endpoints;
+        std::size_t m_consecutive_failures = 0;
+        Clock::time_point m_down_until;
+
+        std::atomic<std::uint64_t> m_requests{0};
+        std::atomic<std::uint64_t> m_responses{0};
+        std::atomic<std::uint64_t> m_reused{0};
+        std::atomic<std::uint64_t> m_connected{0};
+        std::atomic<std::uint64_t> m_failures{0};
+        std::atomic<std::uint64_t> m_latency_ns{0};
+
+        void relay(
+            RequestConcept auto &request,
+            boost::beast::http::response_parser<boost::beast::http::buffer_body> &parser,
+            Connection &&conn,
+            Clock::time_point started)
+        {
+            succeeded();
+            ++m_responses;
+            m_latency_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - started).count();
+
+            bool const reusable = parser.get().keep_alive();
+            boost::beast::error_code upstream_ec;
+
+            request.relay(parser, conn.stream, conn.buffer, upstream_ec);
+
+            if (upstream_ec)
+                ++m_failures;
+
+            release(std::move(conn), reusable && !upstream_ec && parser.is_done());
+        }
+
+        template<typename _Message>
+        void send(_Message &message, Connection &conn, boost::asio::yield_context yield, boost::beast::error_code &ec)
+        {
+            // Upstream connection is kept alive regardless of the client, and
+            // fields of client connection are not passed on
+            bool const keep_alive = message.keep_alive();
+            erase_hop_by_hop(message);
+            message.keep_alive(true);
+
+            conn.stream.expires_after(m_config.timeout);
+            boost::beast::http::async_write(conn.stream, message, yield[ec]);
+
+            message.keep_alive(keep_alive);
+        }
+
+        std::optional<Connection> acquire(
+            boost::asio::any_io_executor executor,
+            boost::asio::yield_context yield,
+            boost::beast::error_code &ec)
+        {
+            std::optional<boost::asio::ip::tcp::resolver::results_type> endpoints;
+            std::shared_ptr<Waiter> waiter;
+            {
+                std::lock_guard lock{m_mutex};
+
+                auto const now = Clock::now();
+                while (!m_idle.empty())
+                {
+                    auto conn = std::move(m_idle.back());
+                    m_idle.pop_back();
+
+                    if (now - conn.idle_since < m_config.idle_timeout && is_alive(conn.stream))
+                    {
+                        ++m_reused;
+                        conn.reused = true;
+                        return conn;
+                    }
+
+                    close(conn.stream);
+                    free_slot();
+                }
+
+                // Those already waiting come first
+                if (m_open < m_config.max_connections && m_waiters.empty())
+                {
+                    ++m_open;
+                    endpoints = m_endpoints;
+                }
+                else
+                {
+                    auto const strand = strand_of(yield);
+                    waiter = std::make_shared<Waiter>();
+                    waiter->executor = strand;
+                    waiter->timer = std::make_shared<boost::asio::steady_timer>(strand, m_config.timeout);
+                    m_waiters.push_back(waiter);
+                }
+            }
+
+            if (waiter)
+            {
+                if (!wait(*waiter, yield))
+                {
+                    ec = boost::asio::error::try_again;
+                    return std::nullopt;
+                }
+
+                if (waiter->conn)
+                {
+                    ++m_reused;
+                    waiter->conn->reused = true;
+                    return std::move(waiter->conn);
+                }
+
+                std::lock_guard lock{m_mutex};
+                endpoints = m_endpoints;
+            }
+
+            if (!endpoints)
+            {
+                boost::asio::ip::tcp::resolver resolver{executor};
+                endpoints = resolver.async_resolve(m_config.host, m_config.port, yield[ec]);
+                if (ec)
+                {
+                    forget();
+                    return std::nullopt;
+                }
+            }
+
+            Connection conn{boost::beast::tcp_stream{executor}};
+            conn.stream.expires_after(m_config.timeout);
+            conn.stream.async_connect(*endpoints, yield[ec]);
+            if (ec)
+            {
+                forget();
+                return std::nullopt;
+            }
+
+            {
+                std::lock_guard lock{m_mutex};
+                m_endpoints = endpoints;
+            }
+
+            ++m_connected;
+            return conn;
+        }
+
+        void release(Connection &&conn, bool reusable)
+        {
+            std::lock_guard lock{m_mutex};
+
+            if (reusable && !m_waiters.empty())
+            {
+                auto waiter = std::move(m_waiters.front());
+                m_waiters.pop_front();
+                waiter->conn.emplace(std::move(conn));
+                wake(*waiter);
+                return;
+            }
+
+            if (reusable && m_idle.size() < m_config.max_idle)
+            {
+                conn.stream.expires_never();
+                conn.idle_since = Clock::now();
+                m_idle.push_back(std::move(conn));
+                return;
+            }
+
+            close(conn.stream);
+            free_slot();
+        }
+
+        // Give up connection slot reserved by acquire(), and resolve again next time
+        void forget()
+        {
+            std::lock_guard lock{m_mutex};
+            m_endpoints.reset();
+            free_slot();
+        }
+
+        // Pass slot of closed connection on to the first in line, if any
+        void free_slot()
+        {
+            if (m_waiters.empty())
+            {
+                --m_open;
+                return;
+            }
+
+            auto waiter = std::move(m_waiters.front());
+            m_waiters.pop_front();
+            waiter->slot = true;
+            wake(*waiter);
+        }
+
+        // Timer is cancelled on the strand of waiting coroutine, which is
+        // running until it waits, so that it cannot miss it
+        static void wake(Waiter &waiter)
+        {
+            boost::asio::post(waiter.executor, [timer = waiter.timer] { timer->cancel(); });
+        }
+
+        //! Wait until connection or slot is handed over, or until timeout
+        bool wait(Waiter &waiter, boost::asio::yield_context yield)
+        {
+            for (;;)
+            {
+                boost::beast::error_code ec;
+                waiter.timer->async_wait(yield[ec]);
+
+                std::lock_guard lock{m_mutex};
+                if (waiter.conn || waiter.slot)
+                    return true;
+
+                if (!ec)
+                {
+                    std::erase_if(m_waiters, [&](auto &other) { return other.get() == &waiter; });
+                    return false;
+                }
+            }
+        }
+
+        //! Strand which the coroutine runs on, as given to spawn()
+        template<typename _Yield>
+        static boost::asio::any_io_executor strand_of(const _Yield &yield)
+        {
+            if constexpr (requires { yield.get_executor(); })
+                return yield.get_executor();
+            else
+                return boost::asio::get_associated_executor(yield.handler_);
+        }
+
+        static bool is_idempotent(boost::beast::http::verb method)
+        {
+            namespace http = boost::beast::http;
+
+            switch (method)
+            {
+            case http::verb::get:
+            case http::verb::head:
+            case http::verb::put:
+            case http::verb::delete_:
+            case http::verb::options:
+            case http::verb::trace:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        bool healthy(Clock::time_point now)
+        {
+            std::lock_guard lock{m_mutex};
+            return m_consecutive_failures < m_config.max_failures || m_down_until <= now;
+        }
+
+        void failed(Clock::time_point now)
+        {
+            ++m_failures;
+
+            std::lock_guard lock{m_mutex};
+            if (++m_consecutive_failures >= m_config.max_failures)
+                m_down_until = now + m_config.retry_after;
+        }
+
+        void succeeded()
+        {
+            std::lock_guard lock{m_mutex};
+            m_consecutive_failures = 0;
+        }
+
+        // Idle connection must have nothing to read, otherwise upstream has
+        // either closed it or sent something unexpected
+        static bool is_alive(boost::beast::tcp_stream &stream)
+        {
+            auto &socket = stream.socket();
+            if (!socket.is_open())
+                return false;
+
+            boost::beast::error_code ec, ignored;
+            char c;
+            socket.non_blocking(true, ignored);
+            socket.receive(boost::asio::buffer(&c, 1), socket.message_peek, ec);
+            socket.non_blocking(false, ignored);
+
+            return ec == boost::asio::error::would_block;
+        }
+
+        static void close(boost::beast::tcp_stream &stream)
+        {
+            boost::beast::error_code ec;
+            stream.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+            stream.close();
+        }
+    };
+
+} //namespace bae::city::beast
+#endif//INCLUDED_BAE_CITY_BEAST_UPSTREAM_HPP
@@ -90,28 +90,50 @@ private:
 
 int main(int argc, const char **argv)
 {
-    if (argc != 5)
+    if (argc != 5 && argc != 6)
     {
         std::cerr <<
-            "Usage: run_app <address> <port> <doc_root> <threads>\n" <<
+            "Usage: run_app <address> <port> <doc_root> <threads> [<unix_socket>]\n" <<
             "Example:\n" <<
-            "    run_app 0.0.0.0 8080 /home/volume/ 1\n";
+            "    run_app 0.0.0.0 8080 /home/volume/ 1\n" <<
+            "    run_app 0.0.0.0 8080 /home/volume/ 1 /tmp/run_app.sock\n";
         return EXIT_FAILURE;
     }
 
+    if constexpr (bae::city::beast::is_io_uring_backend())
+    {
+        if (!bae::city::beast::io_uring_supported())
+        {
+            std::cerr << "io_uring is not supported, falling back to epoll" << std::endl;
+            return bae::city::beast::exec_epoll_fallback(argv);
+        }
+    }
+
     auto const address = argv[1];
     auto const port = std::atoi(argv[2]);
     auto const document_root = argv[3];
     auto const thread_count = std::max<int>(1, std::atoi(argv[4]));
 
+    auto listeners = std::vector{bae::city::beast::ListenerConfig::tcp(address, port)};
+    listeners.front().no_delay = true;
+
+    // Sidecars on the same host can skip both TCP and TLS
+    if (argc == 6)
+        listeners.push_back(bae::city::beast::ListenerConfig::local(argv[5]));
+
 #ifdef HAS_CERT
     auto security = MySecurity{};
-    auto config = bae::city::beast::SecureConfig<MySecurity>{security, address, port, thread_count};
+    auto config = bae::city::beast::SecureConfig<MySecurity>{security, std::move(listeners), thread_count};
 
     auto logger = MyLogger{};
     auto server = MyServer{document_root};
     auto service = bae::city::beast::Service<
         MyLogger, bae::city::beast::DynamicRequests, MyServer>{logger, server};
+
+    auto connection_limiter = bae::city::beast::RateLimiter{{.rate = 100, .burst = 200}};
+    auto request_limiter = bae::city::beast::RateLimiter{{.rate = 1000, .burst = 2000}};
+    service.limit_connections(connection_limiter);
+    service.limit_requests(request_limiter);
     
     return service(config);
 #endif
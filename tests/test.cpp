@@ -24,17 +24,1036 @@
 #include <cassert>
 
 #include "service_config.hpp"
+#include "service.hpp"
+#include "io_backend.hpp"
+#include "memory_stream.hpp"
+#include "rate_limiter.hpp"
+#include "upstream.hpp"
+#include "file_cache.hpp"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
 #include <string>
 #include <boost/lexical_cast.hpp>
+#include <sys/wait.h>
+#include <unistd.h>
 
 
-int main(int argc, const char** argv)
+struct TestLogger
+{
+    void info(auto &&...) {}
+    void error(auto &&...) {}
+};
+
+struct TestServer
+{
+    void operator()(bae::city::beast::RequestConcept auto &&request)
+    {
+        namespace http = boost::beast::http;
+
+        if (request->method() == http::verb::get)
+        {
+            return request.send(request.text_response("Hello!"));
+        }
+
+        return request.send(request.bad_request("Invalid request"));
+    }
+};
+
+void test_service_config()
 {
     bae::city::beast::ServiceConfig config{"0.0.0.0", 8080, 1};
 
     assert(boost::lexical_cast<std::string>(config.address()) == "0.0.0.0");
     assert(config.port() == 8080);
     assert(config.thread_count() == 1);
+    assert(config.listeners().size() == 1);
+    assert(config.listeners().front().tls);
+    assert(!config.listeners().front().is_local());
+}
+
+void test_service_listeners()
+{
+    using namespace bae::city::beast;
+
+    auto v6 = ListenerConfig::tcp("::1", 8443);
+    v6.no_delay = true;
+    v6.backlog = 128;
+    v6.receive_buffer_size = 1 << 20;
+
+    ServiceConfig config{
+        {
+            ListenerConfig::tcp("0.0.0.0", 8080, false),
+            v6,
+            ListenerConfig::local("/tmp/service.sock"),
+        },
+        4};
+
+    auto &listeners = config.listeners();
+    assert(listeners.size() == 3);
+    assert(config.port() == 8080);
+
+    assert(listeners[0].address.is_v4());
+    assert(!listeners[0].tls);
+
+    assert(listeners[1].address.is_v6());
+    assert(listeners[1].port == 8443);
+    assert(listeners[1].tls);
+    assert(listeners[1].no_delay);
+    assert(listeners[1].backlog == 128);
+    assert(listeners[1].receive_buffer_size == 1 << 20);
+    assert(!listeners[1].send_buffer_size);
+
+    assert(listeners[2].is_local());
+    assert(listeners[2].path == "/tmp/service.sock");
+    assert(!listeners[2].tls);
+}
+
+// Request "/" over plain HTTP, and check that server shuts connection down after response
+template<typename _Protocol>
+boost::beast::http::status request_over(
+    boost::asio::io_context &ioc,
+    typename _Protocol::endpoint endpoint,
+    boost::asio::yield_context yield)
+{
+    namespace http = boost::beast::http;
+
+    boost::beast::basic_stream<_Protocol> stream{ioc};
+    stream.connect(endpoint);
+
+    http::request<http::empty_body> req{http::verb::get, "/", 11};
+    req.set(http::field::host, "localhost");
+    req.keep_alive(false);
+    http::async_write(stream, req, yield);
+
+    boost::beast::flat_buffer buffer;
+    http::response<http::string_body> res;
+    http::async_read(stream, buffer, res, yield);
+    assert(res.result() != http::status::ok || res.body() == "Hello!");
+
+    boost::beast::error_code ec;
+    http::response<http::string_body> none;
+    http::async_read(stream, buffer, none, yield[ec]);
+    assert(ec == http::error::end_of_stream);
+
+    return res.result();
+}
+
+void test_service_listen()
+{
+    using namespace bae::city::beast;
+
+    boost::asio::io_context ioc;
+    boost::asio::ssl::context ctx{boost::asio::ssl::context::tlsv12};
+
+    auto logger = TestLogger{};
+    auto server = TestServer{};
+    auto service = Service<TestLogger, StringRequests, TestServer>{logger, server};
+
+    // Socket file left behind by previous run is taken over
+    auto path = (std::filesystem::temp_directory_path() / "bae_city_beast_test.sock").string();
+    std::filesystem::remove(path);
+    {
+        boost::asio::local::stream_protocol::acceptor stale{ioc, {path}};
+    }
+    assert(std::filesystem::is_socket(path));
+
+    // Grab free port, and then close it, so that service can listen there
+    boost::asio::ip::tcp::acceptor probe{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+    auto port = probe.local_endpoint().port();
+    probe.close();
+
+    auto tcp = ListenerConfig::tcp("127.0.0.1", port, false);
+    tcp.no_delay = true;
+    tcp.receive_buffer_size = 1 << 16;
+    tcp.send_buffer_size = 1 << 16;
+
+    auto local = ListenerConfig::local(path);
+    assert(tcp.rate_limited);
+    assert(!local.rate_limited);
+
+    // Local peers share no address, so that they are not limited by default
+    auto limiter = RateLimiter{{.rate = 0.001, .burst = 1}};
+    service.limit_requests(limiter);
+
+    assert(!service.listen(ioc, ctx, tcp));
+    assert(!service.listen(ioc, ctx, local));
+
+    // ...but socket of running instance is not
+    auto other = Service<TestLogger, StringRequests, TestServer>{logger, server};
+    assert(other.listen(ioc, ctx, local) == boost::asio::error::address_in_use);
+    assert(other.listen(ioc, ctx, tcp));
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        namespace http = boost::beast::http;
+
+        auto const tcp_endpoint = boost::asio::ip::tcp::endpoint{boost::asio::ip::make_address("127.0.0.1"), port};
+
+        assert(request_over<boost::asio::local::stream_protocol>(ioc, {path}, yield) == http::status::ok);
+        assert(request_over<boost::asio::ip::tcp>(ioc, tcp_endpoint, yield) == http::status::ok);
+        assert(request_over<boost::asio::ip::tcp>(ioc, tcp_endpoint, yield) == http::status::too_many_requests);
+
+        // Local socket of running instance still works
+        assert(request_over<boost::asio::local::stream_protocol>(ioc, {path}, yield) == http::status::ok);
+        assert(request_over<boost::asio::local::stream_protocol>(ioc, {path}, yield) == http::status::ok);
+        ioc.stop();
+    });
+    ioc.run();
+
+    std::filesystem::remove(path);
+}
+
+void test_memory_stream()
+{
+    using namespace bae::city::beast;
+
+    static_assert(boost::beast::is_async_stream<MemoryStream>::value);
+
+    boost::asio::io_context ioc;
+    MemoryStream stream{ioc.get_executor()};
+
+    stream.feed(
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n"
+        "DELETE / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n");
+
+    auto logger = TestLogger{};
+    auto server = TestServer{};
+    auto service = Service<TestLogger, StringRequests, TestServer>{logger, server};
+
+    bool served = false;
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        served = service.serve(stream, yield);
+    });
+    ioc.run();
+
+    assert(served);
+    assert(stream.input_size() == 0);
+
+    auto output = std::string(stream.output());
+    auto second = output.find("HTTP/1.1 400 Bad Request\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(output.find("\r\n\r\nHello!") != std::string::npos);
+    assert(second != std::string::npos);
+    assert(output.ends_with("Invalid request"));
+}
+
+void test_rate_limiter()
+{
+    using namespace bae::city::beast;
+    using namespace std::chrono_literals;
+
+    RateLimiter limiter{{.rate = 10, .burst = 2}, 16};
+    auto now = RateLimiter::Clock::now();
+
+    assert(limiter.capacity() == 16);
+
+    // burst is available straight away
+    assert(limiter.allow("alice", now));
+    assert(limiter.allow("alice", now));
+    assert(!limiter.allow("alice", now));
+
+    // other keys have their own buckets
+    assert(limiter.allow("bob", now));
+    assert(limiter.allow(boost::asio::ip::make_address("127.0.0.1"), now));
+    assert(limiter.allow(boost::asio::ip::make_address("::1"), now));
+
+    // one token is refilled every 100ms, and partial refills are not lost
+    assert(!limiter.allow("alice", now + 50ms));
+    assert(limiter.allow("alice", now + 100ms));
+    assert(!limiter.allow("alice", now + 150ms));
+    assert(limiter.allow("alice", now + 200ms));
+
+    // bucket never holds more than burst
+    assert(limiter.allow("alice", now + 10s));
+    assert(limiter.allow("alice", now + 10s));
+    assert(!limiter.allow("alice", now + 10s));
+
+    // memory is bounded, and least recently used buckets are evicted
+    RateLimiter shard{{.rate = 1, .burst = 2}, RateLimiter::Ways};
+    assert(shard.capacity() == RateLimiter::Ways);
+
+    assert(shard.allow("mallory", now));
+    assert(shard.allow("mallory", now));
+    assert(!shard.allow("mallory", now));
+
+    // throttled key keeps being used, so other keys churning the shard
+    // cannot evict it, and reset its bucket
+    for (int i = 0; i != 200; ++i)
+    {
+        auto const later = now + std::chrono::milliseconds(i);
+        assert(!shard.allow("mallory", later));
+        assert(shard.allow(std::to_string(i), later));
+    }
+}
+
+void test_rate_limited_service()
+{
+    using namespace bae::city::beast;
+
+    boost::asio::io_context ioc;
+    MemoryStream stream{ioc.get_executor()};
+
+    for (auto user : {"alice", "alice", "bob", "forged-1", "forged-2"})
+    {
+        stream.feed(
+            std::string("GET / HTTP/1.1\r\n") +
+            "Host: localhost\r\n"
+            "Authorization: " + user + "\r\n"
+            "\r\n");
+    }
+
+    auto logger = TestLogger{};
+    auto server = TestServer{};
+    auto service = Service<TestLogger, StringRequests, TestServer>{logger, server};
+    auto limiter = RateLimiter{{.rate = 0.001, .burst = 1}};
+    service.limit_requests(limiter, [](auto &req) -> std::optional<std::string>
+    {
+        auto credential = std::string(req[boost::beast::http::field::authorization]);
+        if (credential == "alice" || credential == "bob")
+            return credential;
+        return std::nullopt;
+    });
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        service.serve(stream, yield);
+    });
+    ioc.run();
+
+    auto output = std::string(stream.output());
+    auto first = output.find("HTTP/1.1 200 OK\r\n");
+    auto second = output.find("HTTP/1.1 429 Too Many Requests\r\n");
+    auto third = output.find("HTTP/1.1 200 OK\r\n", second);
+    assert(first == 0);
+    assert(second != std::string::npos);
+    assert(third != std::string::npos);
+
+    // Unverified credentials share bucket of remote address, so that making
+    // them up does not get around the limit
+    auto fourth = output.find("HTTP/1.1 200 OK\r\n", third + 1);
+    auto fifth = output.find("HTTP/1.1 429 Too Many Requests\r\n", fourth);
+    assert(fourth != std::string::npos);
+    assert(fifth != std::string::npos);
+}
+
+struct ProxyServer
+{
+    bae::city::beast::Upstream &upstream;
+
+    void operator()(bae::city::beast::RequestConcept auto &&request)
+    {
+        return upstream.forward(request);
+    }
+};
+
+// Plain HTTP backend answering each request with chunked response, which
+// tells if fields of client connection were passed on, and has some of its own
+void run_backend(
+    boost::asio::ip::tcp::acceptor &acceptor,
+    int &connections,
+    boost::asio::yield_context yield)
+{
+    namespace http = boost::beast::http;
+
+    boost::beast::error_code ec;
+    for (;;)
+    {
+        boost::beast::tcp_stream stream{acceptor.get_executor()};
+        acceptor.async_accept(stream.socket(), yield[ec]);
+        if (ec)
+            return;
+
+        ++connections;
+        boost::asio::spawn(acceptor.get_executor(), [stream = std::move(stream)](boost::asio::yield_context yield) mutable
+        {
+            boost::beast::error_code ec;
+            boost::beast::flat_buffer buffer;
+            for (;;)
+            {
+                http::request<http::string_body> req;
+                http::async_read(stream, buffer, req, yield[ec]);
+                if (ec)
+                    return;
+
+                bool const leaked = req.count("X-Client-Hop") || req.count(http::field::proxy_authorization) ||
+                    req.count(http::field::te) || req[http::field::connection].find("X-Client-Hop") != boost::beast::string_view::npos;
+
+                http::response<http::string_body> res{http::status::ok, req.version()};
+                res.set(http::field::connection, "X-Backend-Hop");
+                res.set("X-Backend-Hop", "1");
+                res.set(http::field::keep_alive, "timeout=5");
+                res.keep_alive(req.keep_alive());
+                res.chunked(true);
+                res.body() = "Backend: " + std::string(req.target()) + " " + req.body() + (leaked ? " leaked" : "");
+                http::async_write(stream, res, yield[ec]);
+                if (ec || !req.keep_alive())
+                    return;
+            }
+        });
+    }
+}
+
+void test_upstream()
+{
+    using namespace bae::city::beast;
+
+    boost::asio::io_context ioc;
+
+    boost::asio::ip::tcp::acceptor acceptor{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+    int connections = 0;
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        run_backend(acceptor, connections, yield);
+    });
+
+    auto upstream = Upstream{{
+        .host = "127.0.0.1",
+        .port = std::to_string(acceptor.local_endpoint().port())}};
+
+    MemoryStream stream{ioc.get_executor()};
+    stream.feed(
+        "GET /one HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: close, X-Client-Hop\r\n"
+        "X-Client-Hop: 1\r\n"
+        "Proxy-Authorization: Basic eA==\r\n"
+        "TE: trailers\r\n"
+        "\r\n");
+
+    std::string legacy;
+
+    auto logger = TestLogger{};
+    auto server = ProxyServer{upstream};
+    auto service = Service<TestLogger, StringRequests, ProxyServer>{logger, server};
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        // Client asking to close does not close pooled upstream connection,
+        // and fields of either connection are not passed on
+        service.serve(stream, yield);
+        assert(stream.output().find("Connection: close\r\n") != std::string::npos);
+        assert(stream.output().find("Backend: /one ") != std::string::npos);
+        assert(stream.output().find("leaked") == std::string::npos);
+        assert(stream.output().find("X-Backend-Hop") == std::string::npos);
+        assert(stream.output().find("Keep-Alive") == std::string::npos);
+
+        stream.clear_output();
+        stream.feed(
+            "POST /two HTTP/1.1\r\n"
+            "Host: localhost\r\n"
+            "Content-Length: 4\r\n"
+            "\r\n"
+            "body"
+            "GET /three HTTP/1.1\r\n"
+            "Host: localhost\r\n"
+            "\r\n");
+        service.serve(stream, yield);
+
+        // HTTP/1.0 client gets chunked response with body delimited by closing connection
+        MemoryStream old_client{ioc.get_executor()};
+        old_client.feed(
+            "GET /four HTTP/1.0\r\n"
+            "\r\n");
+        service.serve(old_client, yield);
+        legacy = std::string(old_client.output());
+
+        acceptor.close();
+        upstream.close_idle();
+    });
+    ioc.run();
+
+    auto output = std::string(stream.output());
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(output.find("Transfer-Encoding: chunked\r\n") != std::string::npos);
+    assert(output.find("Backend: /two body") != std::string::npos);
+    assert(output.find("Backend: /three ") != std::string::npos);
+
+    assert(legacy.starts_with("HTTP/1.0 200 OK\r\n"));
+    assert(legacy.find("Transfer-Encoding") == std::string::npos);
+    assert(legacy.find("Connection: keep-alive") == std::string::npos);
+    assert(legacy.ends_with("\r\n\r\nBackend: /four "));
+
+    auto stats = upstream.stats();
+    assert(connections == 1);
+    assert(stats.requests == 4);
+    assert(stats.responses == 4);
+    assert(stats.connected == 1);
+    assert(stats.reused == 3);
+    assert(stats.failures == 0);
+    assert(stats.hit_rate() > 0.6);
+}
+
+void test_upstream_pool_exhausted()
+{
+    using namespace bae::city::beast;
+
+    boost::asio::io_context ioc;
+
+    boost::asio::ip::tcp::acceptor acceptor{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+    int connections = 0;
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        run_backend(acceptor, connections, yield);
+    });
+
+    auto upstream = Upstream{{
+        .host = "127.0.0.1",
+        .port = std::to_string(acceptor.local_endpoint().port()),
+        .max_connections = 1,
+        .max_failures = 1}};
+
+    auto logger = TestLogger{};
+    auto server = ProxyServer{upstream};
+    auto service = Service<TestLogger, StringRequests, ProxyServer>{logger, server};
+
+    // Concurrent clients above max_connections wait for connection in turn
+    std::vector<std::unique_ptr<MemoryStream>> streams;
+    int finished = 0;
+    for (int i = 0; i != 3; ++i)
+    {
+        auto &stream = *streams.emplace_back(std::make_unique<MemoryStream>(ioc.get_executor()));
+        stream.feed(
+            "GET /" + std::to_string(i) + " HTTP/1.1\r\n"
+            "Host: localhost\r\n"
+            "\r\n");
+
+        boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+        {
+            service.serve(stream, yield);
+            if (++finished == 3)
+            {
+                acceptor.close();
+                upstream.close_idle();
+            }
+        });
+    }
+    ioc.run();
+
+    for (int i = 0; i != 3; ++i)
+    {
+        auto output = std::string(streams[i]->output());
+        assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+        assert(output.find("Backend: /" + std::to_string(i) + " ") != std::string::npos);
+    }
+
+    auto stats = upstream.stats();
+    assert(connections == 1);
+    assert(stats.connected == 1);
+    assert(stats.reused == 2);
+    assert(stats.failures == 0);
+}
+
+// Plain HTTP backend answering only the first request of each connection,
+// and closing connection once it has read the next one
+void run_flaky_backend(
+    boost::asio::ip::tcp::acceptor &acceptor,
+    std::vector<std::string> &targets,
+    boost::asio::yield_context yield)
+{
+    namespace http = boost::beast::http;
+
+    boost::beast::error_code ec;
+    for (;;)
+    {
+        boost::beast::tcp_stream stream{acceptor.get_executor()};
+        acceptor.async_accept(stream.socket(), yield[ec]);
+        if (ec)
+            return;
+
+        boost::asio::spawn(acceptor.get_executor(), [&targets, stream = std::move(stream)](boost::asio::yield_context yield) mutable
+        {
+            boost::beast::error_code ec;
+            boost::beast::flat_buffer buffer;
+            for (int i = 0; i != 2; ++i)
+            {
+                http::request<http::string_body> req;
+                http::async_read(stream, buffer, req, yield[ec]);
+                if (ec)
+                    return;
+
+                targets.push_back(std::string(req.target()));
+                if (i != 0)
+                    break;
+
+                http::response<http::string_body> res{http::status::ok, req.version()};
+                res.keep_alive(true);
+                res.body() = "Backend: " + std::string(req.target());
+                res.prepare_payload();
+                http::async_write(stream, res, yield[ec]);
+                if (ec)
+                    return;
+            }
+            stream.socket().close(ec);
+        });
+    }
+}
+
+void test_upstream_retry()
+{
+    using namespace bae::city::beast;
+
+    boost::asio::io_context ioc;
+
+    boost::asio::ip::tcp::acceptor acceptor{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+    std::vector<std::string> targets;
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        run_flaky_backend(acceptor, targets, yield);
+    });
+
+    auto upstream = Upstream{{
+        .host = "127.0.0.1",
+        .port = std::to_string(acceptor.local_endpoint().port())}};
+
+    MemoryStream stream{ioc.get_executor()};
+    stream.feed(
+        "GET /one HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n"
+        "POST /two HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Length: 4\r\n"
+        "\r\n"
+        "body"
+        "GET /three HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n"
+        "GET /four HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n");
+
+    auto logger = TestLogger{};
+    auto server = ProxyServer{upstream};
+    auto service = Service<TestLogger, StringRequests, ProxyServer>{logger, server};
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        service.serve(stream, yield);
+        acceptor.close();
+        upstream.close_idle();
+    });
+    ioc.run();
+
+    // POST reached upstream over reused connection, which was then closed,
+    // so that it is not sent again, whereas GET is
+    assert((targets == std::vector<std::string>{"/one", "/two", "/three", "/four", "/four"}));
+
+    auto output = std::string(stream.output());
+    auto bad_gateway = output.find("HTTP/1.1 502 Bad Gateway\r\n");
+    assert(bad_gateway != std::string::npos);
+    assert(output.find("Backend: /one") < bad_gateway);
+    assert(output.find("Backend: /three") > bad_gateway);
+    assert(output.find("Backend: /four") != std::string::npos);
+}
+
+void test_upstream_down()
+{
+    using namespace bae::city::beast;
+
+    boost::asio::io_context ioc;
+
+    // Grab free port, and then close it, so that nothing listens there
+    boost::asio::ip::tcp::acceptor acceptor{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+    auto port = acceptor.local_endpoint().port();
+    acceptor.close();
+
+    auto upstream = Upstream{{
+        .host = "127.0.0.1",
+        .port = std::to_string(port),
+        .max_failures = 1}};
+
+    MemoryStream stream{ioc.get_executor()};
+    for (int i = 0; i != 2; ++i)
+        stream.feed(
+            "GET / HTTP/1.1\r\n"
+            "Host: localhost\r\n"
+            "\r\n");
+
+    auto logger = TestLogger{};
+    auto server = ProxyServer{upstream};
+    auto service = Service<TestLogger, StringRequests, ProxyServer>{logger, server};
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        service.serve(stream, yield);
+    });
+    ioc.run();
+
+    auto output = std::string(stream.output());
+    assert(output.starts_with("HTTP/1.1 502 Bad Gateway\r\n"));
+    assert(output.find("Upstream is down") != std::string::npos);
+
+    auto stats = upstream.stats();
+    assert(stats.requests == 2);
+    assert(stats.failures == 2);
+    assert(stats.connected == 0);
+}
+
+struct StreamingServer
+{
+    void operator()(bae::city::beast::RequestConcept auto &&request)
+    {
+        if (request->target() == "/chunked")
+        {
+            auto writer = request.open_response("text/csv");
+            for (auto row : {"a,b\n", "1,2\n", "3,4\n"})
+                if (!writer.write(row))
+                    return;
+            writer.finish();
+        }
+        else if (request->target() == "/sized")
+        {
+            auto writer = request.open_response("text/plain", 11);
+            writer.write("Hello");
+            writer.write(" world");
+            writer.finish();
+        }
+        else if (request->target() == "/events")
+        {
+            auto writer = request.open_response("text/event-stream");
+            writer.header().set(boost::beast::http::field::cache_control, "no-cache");
+            writer.write_event("one");
+            writer.write_event("two\nlines", "update");
+            writer.finish();
+        }
+        else if (request->target() == "/short")
+        {
+            // Finishing response shorter than announced fails
+            auto writer = request.open_response("text/plain", 10);
+            writer.write("short");
+            [[maybe_unused]] bool finished = writer.finish();
+            assert(!finished);
+        }
+        else
+        {
+            // Abandoned response forces connection to close
+            auto writer = request.open_response("text/plain", 100);
+            writer.write("partial");
+        }
+    }
+};
+
+void test_streaming_response()
+{
+    using namespace bae::city::beast;
+
+    boost::asio::io_context ioc;
+    MemoryStream stream{ioc.get_executor()};
+
+    // Response to HEAD has no body, so that the next response follows the header
+    stream.feed(
+        "HEAD /chunked HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n");
+
+    for (auto target : {"/chunked", "/sized", "/events", "/partial", "/never"})
+        stream.feed(
+            std::string("GET ") + target + " HTTP/1.1\r\n"
+            "Host: localhost\r\n"
+            "\r\n");
+
+    auto logger = TestLogger{};
+    auto server = StreamingServer{};
+    auto service = Service<TestLogger, StringRequests, StreamingServer>{logger, server};
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        service.serve(stream, yield);
+    });
+    ioc.run();
+
+    auto output = std::string(stream.output());
+
+    assert(output.find("Transfer-Encoding: chunked\r\n\r\nHTTP/1.1 200 OK\r\n") != std::string::npos);
+    assert(output.find("Content-Type: text/csv\r\nTransfer-Encoding: chunked\r\n\r\n"
+                       "4\r\na,b\n\r\n4\r\n1,2\n\r\n4\r\n3,4\n\r\n0\r\n\r\n") != std::string::npos);
+    assert(output.find("Content-Length: 11\r\n\r\nHello world") != std::string::npos);
+    assert(output.find("Cache-Control: no-cache\r\n") != std::string::npos);
+    assert(output.find("data: one\n\n") != std::string::npos);
+    assert(output.find("event: update\ndata: two\ndata: lines\n\n") != std::string::npos);
+    assert(output.ends_with("partial"));
+
+    // The last request was never served, as connection got closed
+    int responses = 0;
+    for (auto pos = output.find("HTTP/1.1 200 OK"); pos != std::string::npos; pos = output.find("HTTP/1.1 200 OK", pos + 1))
+        ++responses;
+    assert(responses == 5);
+
+    // HTTP/1.0 knows no chunked encoding, so that body is delimited by closing connection
+    MemoryStream legacy{ioc.get_executor()};
+    legacy.feed(
+        "GET /chunked HTTP/1.0\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+        "GET /never HTTP/1.0\r\n"
+        "\r\n");
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        service.serve(legacy, yield);
+    });
+    ioc.restart();
+    ioc.run();
+
+    output = std::string(legacy.output());
+    assert(output.starts_with("HTTP/1.0 200 OK\r\n"));
+    assert(output.find("Transfer-Encoding") == std::string::npos);
+    assert(output.find("Connection: keep-alive") == std::string::npos);
+    assert(output.ends_with("\r\n\r\na,b\n1,2\n3,4\n"));
+
+    MemoryStream truncated{ioc.get_executor()};
+    truncated.feed(
+        "GET /short HTTP/1.1\r\n"
+        "\r\n"
+        "GET /never HTTP/1.1\r\n"
+        "\r\n");
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+    {
+        [[maybe_unused]] bool served = service.serve(truncated, yield);
+        assert(!served);
+    });
+    ioc.restart();
+    ioc.run();
+
+    assert(std::string(truncated.output()).ends_with("\r\n\r\nshort"));
+}
+
+struct FileServer
+{
+    bae::city::beast::FileCache &cache;
+    std::string path;
+
+    void operator()(bae::city::beast::RequestConcept auto &&request)
+    {
+        cache.serve(request, path, "text/plain");
+    }
+};
+
+void test_file_cache()
+{
+    using namespace bae::city::beast;
+
+    auto path = (std::filesystem::temp_directory_path() / "bae_city_beast_test_file.txt").string();
+    std::ofstream(path) << "0123456789abcdefghij";
+
+    // File modified long ago gets strong tag
+    std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) - std::chrono::hours(1));
+
+    // Validators are cached for the whole test, unless files sent tell otherwise
+    FileCache cache{4096, std::chrono::hours(1)};
+    auto info = cache.info(path);
+    assert(info);
+    assert(info->size == 20);
+    assert(!info->etag.starts_with("W/"));
+    assert(parse_http_date(info->last_modified) == info->modified);
+    assert(!cache.info(path + ".missing"));
+
+    auto fetch = [&](std::string headers, std::string method = "GET")
+    {
+        boost::asio::io_context ioc;
+        MemoryStream stream{ioc.get_executor()};
+        stream.feed(method + " /file HTTP/1.1\r\nHost: localhost\r\n" + headers + "\r\n");
+
+        auto logger = TestLogger{};
+        auto server = FileServer{cache, path};
+        auto service = Service<TestLogger, StringRequests, FileServer>{logger, server};
+
+        boost::asio::spawn(ioc, [&](boost::asio::yield_context yield)
+        {
+            service.serve(stream, yield);
+        });
+        ioc.run();
+
+        return std::string(stream.output());
+    };
+
+    auto output = fetch("");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(output.find("ETag: " + info->etag + "\r\n") != std::string::npos);
+    assert(output.find("Accept-Ranges: bytes\r\n") != std::string::npos);
+    assert(output.ends_with("\r\n\r\n0123456789abcdefghij"));
+
+    output = fetch("If-None-Match: \"other\", " + info->etag + "\r\n");
+    assert(output.starts_with("HTTP/1.1 304 Not Modified\r\n"));
+    assert(output.find("ETag: " + info->etag + "\r\n") != std::string::npos);
+    assert(output.ends_with("\r\n\r\n"));
+
+    // If-None-Match takes precedence over If-Modified-Since
+    output = fetch("If-None-Match: \"other\"\r\nIf-Modified-Since: " + info->last_modified + "\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+
+    output = fetch("If-Modified-Since: " + info->last_modified + "\r\n");
+    assert(output.starts_with("HTTP/1.1 304 Not Modified\r\n"));
+
+    output = fetch("If-Modified-Since: " + http_date(info->modified - 10) + "\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+
+    output = fetch("Range: bytes=0-4\r\n");
+    assert(output.starts_with("HTTP/1.1 206 Partial Content\r\n"));
+    assert(output.find("Content-Range: bytes 0-4/20\r\n") != std::string::npos);
+    assert(output.find("Content-Length: 5\r\n") != std::string::npos);
+    assert(output.ends_with("\r\n\r\n01234"));
+
+    output = fetch("Range: bytes=-3\r\n");
+    assert(output.find("Content-Range: bytes 17-19/20\r\n") != std::string::npos);
+    assert(output.ends_with("\r\n\r\nhij"));
+
+    output = fetch("Range: bytes=18-100\r\nIf-Range: " + info->etag + "\r\n");
+    assert(output.find("Content-Range: bytes 18-19/20\r\n") != std::string::npos);
+    assert(output.ends_with("\r\n\r\nij"));
+
+    output = fetch("Range: bytes=0-1, 10-\r\n");
+    assert(output.starts_with("HTTP/1.1 206 Partial Content\r\n"));
+    assert(output.find("Content-Type: multipart/byteranges; boundary=") != std::string::npos);
+    assert(output.find("Content-Range: bytes 0-1/20\r\n\r\n01\r\n--") != std::string::npos);
+    assert(output.find("Content-Range: bytes 10-19/20\r\n\r\nabcdefghij\r\n--") != std::string::npos);
+    assert(output.ends_with("--\r\n"));
+
+    // Declared length must match what was written, or connection would be closed
+    auto boundary = output.substr(output.find("boundary=") + 9);
+    boundary = boundary.substr(0, boundary.find("\r\n"));
+    auto body = output.substr(output.find("\r\n\r\n") + 4);
+    assert(output.find("Content-Length: " + std::to_string(body.size()) + "\r\n") != std::string::npos);
+    assert(body.ends_with("\r\n--" + boundary + "--\r\n"));
+
+    // Overlapping and adjacent ranges are merged, so that nothing is sent twice
+    output = fetch("Range: bytes=5-6, 0-1, 1-3\r\n");
+    assert(output.find("Content-Range: bytes 0-3/20\r\n\r\n0123\r\n--") != std::string::npos);
+    assert(output.find("Content-Range: bytes 5-6/20\r\n\r\n56\r\n--") != std::string::npos);
+
+    output = fetch("Range: bytes=0-9, 10-19\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+
+    std::string repeated = "Range: bytes=0-";
+    for (int i = 0; i != 15; ++i)
+        repeated += ",0-";
+    output = fetch(repeated + "\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(output.ends_with("\r\n\r\n0123456789abcdefghij"));
+
+    output = fetch("Range: bytes=20-30\r\n");
+    assert(output.starts_with("HTTP/1.1 416 Range Not Satisfiable\r\n"));
+    assert(output.find("Content-Range: bytes */20\r\n") != std::string::npos);
+
+    // Range is ignored if invalid, or when client has different representation
+    output = fetch("Range: lines=1-2\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+
+    output = fetch("Range: bytes=0-4\r\nIf-Range: \"other\"\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(output.ends_with("0123456789abcdefghij"));
+
+    output = fetch("", "HEAD");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(output.find("Content-Length: 20\r\n") != std::string::npos);
+    assert(output.ends_with("\r\n\r\n"));
+
+    assert(parse_ranges("bytes=5-1", 20) == std::nullopt);
+    auto merged = parse_ranges("bytes=10-12,-5,0-0,11-", 20);
+    assert(merged && merged->size() == 2);
+    assert(merged->at(0).first == 0 && merged->at(0).last == 0);
+    assert(merged->at(1).first == 10 && merged->at(1).last == 19);
+    assert(parse_ranges("bytes=0-0,0-0,0-0", 20, 2) == std::nullopt);
+    assert(etag_matches("W/\"a\"", "\"a\"", true));
+    assert(!etag_matches("W/\"a\"", "\"a\"", false));
+
+    // File replaced while validators are cached is sent with validators of
+    // its own, and range of old one is not spliced into it
+    std::ofstream(path) << "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) - std::chrono::hours(2));
+    assert(cache.info(path)->etag == info->etag);
+
+    output = fetch("Range: bytes=0-4\r\nIf-Range: " + info->etag + "\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(output.find("ETag: " + info->etag + "\r\n") == std::string::npos);
+    assert(output.find("Content-Length: 26\r\n") != std::string::npos);
+    assert(output.ends_with("\r\n\r\nABCDEFGHIJKLMNOPQRSTUVWXYZ"));
+
+    // ...and cache is updated
+    assert(cache.info(path)->size == 26);
+    output = fetch("If-None-Match: " + info->etag + "\r\n");
+    assert(output.starts_with("HTTP/1.1 200 OK\r\n"));
+
+    std::filesystem::remove(path);
+}
+
+void test_io_backend(const char **argv)
+{
+    using namespace bae::city::beast;
+
+    assert(std::string(io_backend_name()) == (is_io_uring_backend() ? "io_uring" : "epoll"));
+
+    // Fallback runs sibling built for epoll, which only exists for io_uring
+    // build, and otherwise it fails
+    int out[2];
+    assert(::pipe(out) == 0);
+
+    auto pid = ::fork();
+    assert(pid >= 0);
+    if (pid == 0)
+    {
+        ::dup2(out[1], STDOUT_FILENO);
+        const char *args[] = {argv[0], "--backend", nullptr};
+        ::_exit(exec_epoll_fallback(args));
+    }
+    ::close(out[1]);
+
+    char buf[64];
+    auto size = ::read(out[0], buf, sizeof(buf));
+    ::close(out[0]);
+
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+    assert(WIFEXITED(status));
+
+    if (is_io_uring_backend())
+    {
+        assert(WEXITSTATUS(status) == EXIT_SUCCESS);
+        assert(std::string(buf, std::max<ssize_t>(size, 0)) == "epoll\n");
+    }
+    else
+    {
+        assert(WEXITSTATUS(status) == EXIT_FAILURE);
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    using namespace bae::city::beast;
+
+    if (argc == 2 && std::string(argv[1]) == "--backend")
+    {
+        std::cout << io_backend_name() << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    if (is_io_uring_backend() && !io_uring_supported())
+    {
+        std::cerr << "io_uring is not supported, falling back to epoll" << std::endl;
+        return exec_epoll_fallback(argv);
+    }
+
+    test_service_config();
+    test_service_listeners();
+    test_service_listen();
+    test_memory_stream();
+    test_rate_limiter();
+    test_rate_limited_service();
+    test_upstream();
+    test_upstream_pool_exhausted();
+    test_upstream_retry();
+    test_upstream_down();
+    test_streaming_response();
+    test_file_cache();
+    test_io_backend(argv);
 
     return 0;
 }